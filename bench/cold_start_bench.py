@@ -0,0 +1,155 @@
+"""Cold-start benchmark of the example models.
+
+Each measurement runs in a fresh process, so the library load, the
+lua state with torch and nn, the graph passes and the creation of the
+op closures and nn modules are all paid again. The time is broken down
+by phase and compared against a threshold file, which is written by
+--update on the reference machine and records that machine. Without
+the file nothing is checked.
+
+Example:
+  python bench/cold_start_bench.py --repeat 5 --update  # on the reference machine
+  python bench/cold_start_bench.py --repeat 3 --check
+"""
+from __future__ import print_function
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import subprocess
+import sys
+import time
+
+CURR_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_THRESHOLDS = os.path.join(CURR_DIR, "cold_start_thresholds.json")
+MODELS = ["mnist_softmax", "mnist_lenet", "cifar_resnet"]
+# phases recorded by the session profiler during setup.
+PROFILE_PHASES = ["TorchState", "InferShape", "PlanMemory", "SetupStorage",
+                  "SetupOpExecs", "Setup"]
+
+
+def child(model, config, batch_size):
+    """Measure the cold start of one model in this process."""
+    tic = time.time()
+    import numpy as np
+    import tinyflow as tf
+    sys.path.insert(0, CURR_DIR)
+    from e2e_bench import MODELS as BUILDERS
+    ret = {"import_ms": (time.time() - tic) * 1000.0}
+
+    t = time.time()
+    x, label, logits, loss, train_step, in_shape, make_label = BUILDERS[model]()
+    ret["graph_ms"] = (time.time() - t) * 1000.0
+    t = time.time()
+    sess = tf.Session(config=config + ",profile")
+    ret["session_ms"] = (time.time() - t) * 1000.0
+
+    rng = np.random.RandomState(0)
+    labels = rng.randint(0, 10, size=batch_size)
+    feed = {
+        x: rng.uniform(0, 1, size=[batch_size] + in_shape).astype(np.float32),
+        label: make_label(labels) if make_label else labels.astype(np.float32)
+    }
+    t = time.time()
+    known_shape = {x: [batch_size] + in_shape, label: list(feed[label].shape)}
+    init_step = [tf.assign(v, tf.normal(shape, 0.01)) for v, _, shape in
+                 tf.infer_variable_shapes(loss, feed_dict=known_shape)]
+    if init_step:
+        sess.run(init_step)
+    sess.run(tf.initialize_all_variables())
+    ret["init_ms"] = (time.time() - t) * 1000.0
+    t = time.time()
+    sess.run([loss, train_step], feed_dict=feed)
+    ret["first_train_ms"] = (time.time() - t) * 1000.0
+    t = time.time()
+    sess.run(logits, feed_dict={x: feed[x]})
+    ret["first_infer_ms"] = (time.time() - t) * 1000.0
+    ret["total_ms"] = (time.time() - tic) * 1000.0
+    phases = sess.profile()["phases"]
+    for name in PROFILE_PHASES:
+        ret[name + "_ms"] = phases.get(name, {}).get("total_us", 0.0) / 1000.0
+    print(json.dumps(ret))
+
+
+def machine():
+    """Description of this machine, stored with the thresholds."""
+    return "%s %s, %d cpus, %s" % (
+        platform.system(), platform.machine(), multiprocessing.cpu_count(),
+        platform.processor() or "unknown processor")
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--model", action="append", choices=MODELS,
+                        help="models to run, all by default")
+    parser.add_argument("--config", default="cpu", help="session config")
+    parser.add_argument("--batch-size", type=int, default=100)
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="number of processes per model, the median is reported")
+    parser.add_argument("--thresholds", default=DEFAULT_THRESHOLDS)
+    parser.add_argument("--check", action="store_true",
+                        help="exit with error if a phase exceeds its threshold")
+    parser.add_argument("--update", action="store_true",
+                        help="rewrite the thresholds as the measurement plus --margin")
+    parser.add_argument("--margin", type=float, default=0.5,
+                        help="relative slack of updated thresholds")
+    parser.add_argument("--out", help="json output file, stdout by default")
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if args.child:
+        child(args.child, args.config, args.batch_size)
+        return
+
+    results = {}
+    for model in (args.model or MODELS):
+        samples = []
+        for i in range(args.repeat):
+            out = subprocess.check_output(
+                [sys.executable, os.path.abspath(__file__), "--child", model,
+                 "--config", args.config, "--batch-size", str(args.batch_size)])
+            samples.append(json.loads(out.decode("utf-8").strip().split("\n")[-1]))
+        results[model] = dict((k, median([s[k] for s in samples])) for k in samples[0])
+        print("%s: cold start %.1f ms" % (model, results[model]["total_ms"]),
+              file=sys.stderr)
+
+    thresholds = {}
+    if os.path.exists(args.thresholds):
+        with open(args.thresholds) as f:
+            thresholds = json.load(f)
+    elif args.check:
+        print("no thresholds at %s, run --update on the reference machine, "
+              "nothing is checked" % args.thresholds, file=sys.stderr)
+    failures = []
+    for model, res in results.items():
+        for key, limit in thresholds.get("models", {}).get(model, {}).items():
+            if key in res and res[key] > limit:
+                failures.append("%s %s: %.1f ms > %.1f ms" % (model, key, res[key], limit))
+    out = open(args.out, "w") if args.out else sys.stdout
+    json.dump({"config": args.config, "machine": machine(),
+               "results": results, "failures": failures},
+              out, indent=2, sort_keys=True)
+    out.write("\n")
+
+    if args.update:
+        thresholds["machine"] = machine()
+        thresholds["config"] = args.config
+        for model, res in results.items():
+            thresholds.setdefault("models", {})[model] = dict(
+                (k, round(v * (1 + args.margin), 1)) for k, v in res.items())
+        with open(args.thresholds, "w") as f:
+            json.dump(thresholds, f, indent=2, sort_keys=True)
+            f.write("\n")
+    elif args.check and failures:
+        for msg in failures:
+            print("cold start regression: " + msg, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
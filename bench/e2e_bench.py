@@ -0,0 +1,185 @@
+"""End-to-end benchmark of the example models on synthetic data.
+
+Reports cold setup latency, training and inference throughput,
+p50/p99 step latency and peak memory of each model as json. Each model
+runs in a fresh process, so the peak resident size is its own.
+
+Example: python bench/e2e_bench.py --config cpu --steps 50 --out e2e.json
+"""
+from __future__ import print_function
+import argparse
+import json
+import os
+import resource
+import subprocess
+import sys
+import time
+import numpy as np
+import tinyflow as tf
+
+
+def mnist_softmax():
+    x = tf.placeholder(tf.float32)
+    W = tf.Variable(tf.zeros([784, 10]))
+    y = tf.nn.softmax(tf.matmul(x, W))
+    y_ = tf.placeholder(tf.float32)
+    cross_entropy = tf.reduce_mean(-tf.reduce_sum(y_ * tf.log(y), reduction_indices=[1]))
+    train_step = tf.train.GradientDescentOptimizer(0.5).minimize(cross_entropy)
+    def make_label(labels):
+        return np.eye(10, dtype=np.float32)[labels]
+    return x, y_, y, cross_entropy, train_step, [784], make_label
+
+
+def mnist_lenet():
+    x = tf.placeholder(tf.float32)
+    conv1 = tf.nn.conv2d(x, num_filter=20, ksize=[1, 5, 5, 1], name="conv1", no_bias=False)
+    tanh1 = tf.tanh(conv1)
+    pool1 = tf.nn.max_pool(tanh1, ksize=[1, 2, 2, 1], strides=[1, 2, 2, 1])
+    conv2 = tf.nn.conv2d(pool1, num_filter=50, ksize=[1, 5, 5, 1], name="conv2", no_bias=False)
+    tanh2 = tf.tanh(conv2)
+    pool2 = tf.nn.max_pool(tanh2, ksize=[1, 2, 2, 1], strides=[1, 2, 2, 1])
+    flatten = tf.nn.flatten_layer(pool2)
+    fc1 = tf.nn.linear(flatten, num_hidden=500, name="fc1")
+    tanh3 = tf.tanh(fc1)
+    fc2 = tf.nn.linear(tanh3, num_hidden=10, name="fc2")
+    label = tf.placeholder(tf.float32)
+    cross_entropy = tf.nn.mean_sparse_softmax_cross_entropy_with_logits(fc2, label)
+    train_step = tf.train.AdamOptimizer(0.005).minimize(cross_entropy)
+    return x, label, fc2, cross_entropy, train_step, [1, 28, 28], None
+
+
+def cifar_resnet():
+    def conv_factory(x, filter_size, out_filters):
+        x = tf.nn.conv2d(x, num_filter=out_filters,
+                         ksize=[1, filter_size, filter_size, 1], padding='SAME')
+        x = tf.nn.batch_normalization(x)
+        return tf.nn.relu(x)
+
+    def residual_factory(x, in_filters, out_filters):
+        conv1 = conv_factory(x, 3, out_filters)
+        conv2 = conv_factory(conv1, 3, out_filters)
+        orig_x = x if in_filters == out_filters else conv_factory(x, 1, out_filters)
+        return tf.nn.relu(orig_x + conv2)
+
+    x = tf.placeholder(tf.float32)
+    conv1 = tf.nn.conv2d(x, num_filter=16, ksize=[1, 5, 5, 1], padding='SAME')
+    res = tf.tanh(conv1)
+    for in_filters, out_filters in [(16, 16), (16, 32), (32, 64)]:
+        res = residual_factory(res, in_filters, out_filters)
+    pool1 = tf.nn.avg_pool(res, ksize=[1, 4, 4, 1], strides=[1, 2, 2, 1],
+                           padding='SAME', data_format='NCHW')
+    conv2 = tf.nn.conv2d(pool1, num_filter=16, ksize=[1, 5, 5, 1])
+    flatten = tf.nn.flatten_layer(conv2)
+    fc1 = tf.nn.linear(flatten, num_hidden=10, name="fc1")
+    label = tf.placeholder(tf.float32)
+    cross_entropy = tf.nn.mean_sparse_softmax_cross_entropy_with_logits(fc1, label)
+    train_step = tf.train.AdamOptimizer(0.0005).minimize(cross_entropy)
+    return x, label, fc1, cross_entropy, train_step, [3, 32, 32], None
+
+
+MODELS = {
+    "mnist_softmax": mnist_softmax,
+    "mnist_lenet": mnist_lenet,
+    "cifar_resnet": cifar_resnet,
+}
+
+
+def max_rss_bytes():
+    """Peak resident size of this process."""
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # bytes on darwin, kilobytes elsewhere.
+    return rss if sys.platform == "darwin" else rss * 1024
+
+
+def timed(func):
+    tic = time.time()
+    func()
+    return time.time() - tic
+
+
+def latency_stats(seconds, batch_size):
+    ms = np.array(seconds) * 1000.0
+    return {
+        "images_per_sec": batch_size / np.mean(seconds),
+        "mean_ms": float(np.mean(ms)),
+        "p50_ms": float(np.percentile(ms, 50)),
+        "p99_ms": float(np.percentile(ms, 99)),
+    }
+
+
+def bench_model(name, args):
+    x, label, logits, loss, train_step, in_shape, make_label = MODELS[name]()
+    sess = tf.Session(config=args.config)
+    batch_size = args.batch_size
+    rng = np.random.RandomState(0)
+    labels = rng.randint(0, 10, size=batch_size)
+    feed = {
+        x: rng.uniform(0, 1, size=[batch_size] + in_shape).astype(np.float32),
+        label: make_label(labels) if make_label else labels.astype(np.float32)
+    }
+    known_shape = {x: [batch_size] + in_shape, label: list(feed[label].shape)}
+    init_step = [tf.assign(v, tf.normal(shape, 0.01)) for v, _, shape in
+                 tf.infer_variable_shapes(loss, feed_dict=known_shape)]
+    init_time = timed(lambda: (sess.run(init_step) if init_step else None,
+                               sess.run(tf.initialize_all_variables())))
+
+    ret = {"model": name, "config": args.config, "batch_size": batch_size,
+           "init_ms": init_time * 1000.0}
+    # the first runs set up the executors.
+    ret["train_cold_ms"] = timed(lambda: sess.run([loss, train_step], feed_dict=feed)) * 1000.0
+    ret["infer_cold_ms"] = timed(lambda: sess.run(logits, feed_dict={x: feed[x]})) * 1000.0
+    for i in range(args.warmup):
+        sess.run([loss, train_step], feed_dict=feed)
+    ret["train"] = latency_stats(
+        [timed(lambda: sess.run([loss, train_step], feed_dict=feed))
+         for i in range(args.steps)], batch_size)
+    for i in range(args.warmup):
+        sess.run(logits, feed_dict={x: feed[x]})
+    ret["infer"] = latency_stats(
+        [timed(lambda: sess.run(logits, feed_dict={x: feed[x]}))
+         for i in range(args.steps)], batch_size)
+    report = sess.memory_report()
+    ret["memory"] = {
+        "variable_bytes": report["variable_bytes"],
+        "activation_bytes": report["activation_bytes"],
+        "output_bytes": report["output_bytes"],
+        "planned_peak_bytes": report["planned_peak_bytes"],
+        "total_bytes": report["total_bytes"],
+        # peak resident size of the process, which only runs this model.
+        "max_rss_bytes": max_rss_bytes(),
+    }
+    return ret
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--model", action="append", choices=sorted(MODELS.keys()),
+                        help="models to run, all by default")
+    parser.add_argument("--config", default="cpu", help="session config")
+    parser.add_argument("--batch-size", type=int, default=100)
+    parser.add_argument("--warmup", type=int, default=5)
+    parser.add_argument("--steps", type=int, default=50)
+    parser.add_argument("--out", help="json output file, stdout by default")
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if args.child:
+        print(json.dumps(bench_model(args.child, args)))
+        return
+
+    results = []
+    for name in (args.model or sorted(MODELS.keys())):
+        out = subprocess.check_output(
+            [sys.executable, os.path.abspath(__file__), "--child", name,
+             "--config", args.config, "--batch-size", str(args.batch_size),
+             "--warmup", str(args.warmup), "--steps", str(args.steps)])
+        results.append(json.loads(out.decode("utf-8").strip().split("\n")[-1]))
+        print("%s: train %.1f images/sec, infer %.1f images/sec" % (
+            name, results[-1]["train"]["images_per_sec"],
+            results[-1]["infer"]["images_per_sec"]), file=sys.stderr)
+    out = open(args.out, "w") if args.out else sys.stdout
+    json.dump({"results": results}, out, indent=2)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,305 @@
+// Copyright (c) 2016 by Contributors
+// microbenchmark of the registered operators over a sweep of shapes.
+// Usage: op_bench [device=cpu|gpu] [filter=op_name] [min_time=seconds] [out=file]
+// The results are written as json to out, or stdout.
+#include <tinyflow/base.h>
+#include <dmlc/json.h>
+#include <dmlc/logging.h>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace tinyflow {
+namespace bench {
+
+// floating point operations of one run, given input and output shapes.
+using FFlops = std::function<double(const std::vector<TShape>& in, const TShape& out)>;
+
+// one op applied on placeholders of given shapes.
+struct OpCase {
+  std::string op;
+  std::unordered_map<std::string, std::string> attrs;
+  std::vector<TShape> shapes;
+  // nullptr if the op is bound by memory bandwidth.
+  FFlops flops;
+  // range of the random input data.
+  float low{-1.0f};
+  float high{1.0f};
+  // input filled with class labels in [0, num_class), -1 if none.
+  int label_input{-1};
+  int num_class{0};
+};
+
+// measurement of one case.
+struct OpResult {
+  std::string op;
+  std::string shape;
+  std::map<std::string, std::string> attrs;
+  // time of the op closure per run.
+  double kernel_us{0};
+  // time of Session::Run per call, including copies.
+  double run_us{0};
+  size_t iters{0};
+  double gflops{0};
+  double gbps{0};
+  // error raised by the case, empty if it ran.
+  std::string error;
+  inline void Save(dmlc::JSONWriter* writer) const {
+    writer->BeginObject();
+    writer->WriteObjectKeyValue("op", op);
+    writer->WriteObjectKeyValue("shape", shape);
+    writer->WriteObjectKeyValue("attrs", attrs);
+    if (error.length() != 0) {
+      writer->WriteObjectKeyValue("error", error);
+      writer->EndObject();
+      return;
+    }
+    writer->WriteObjectKeyValue("kernel_us", kernel_us);
+    writer->WriteObjectKeyValue("run_us", run_us);
+    writer->WriteObjectKeyValue("iters", iters);
+    if (gflops != 0) {
+      writer->WriteObjectKeyValue("gflops", gflops);
+    } else {
+      writer->WriteObjectKeyValue("gbps", gbps);
+    }
+    writer->EndObject();
+  }
+};
+
+// 2 * size of output * length of the reduced dimension.
+inline FFlops MatMulFlops(size_t input, size_t dim) {
+  return [input, dim](const std::vector<TShape>& in, const TShape& out) {
+    return 2.0 * out.Size() * in[input][dim];
+  };
+}
+
+inline double ConvFlops(const std::vector<TShape>& in, const TShape& out) {
+  // weight is (num_filter, channel, kh, kw)
+  return 2.0 * out.Size() * in[1][1] * in[1][2] * in[1][3];
+}
+
+std::vector<OpCase> MakeCases() {
+  std::vector<OpCase> cases;
+  auto add = [&cases](const std::string& op,
+                      std::unordered_map<std::string, std::string> attrs,
+                      std::vector<TShape> shapes, FFlops flops) {
+    OpCase c;
+    c.op = op;
+    c.attrs = std::move(attrs);
+    c.shapes = std::move(shapes);
+    c.flops = flops;
+    cases.push_back(c);
+    return &cases.back();
+  };
+  const std::vector<TShape> ewise_shapes = {
+    TShape{64, 784}, TShape{256, 1024}, TShape{1024, 4096}};
+  for (const TShape& s : ewise_shapes) {
+    for (const char* op : {"__add_symbol__", "__sub_symbol__", "mul",
+                           "__div_symbol__", "__pow_symbol__"}) {
+      OpCase* c = add(op, {}, {s, s}, nullptr);
+      if (c->op == "__pow_symbol__" || c->op == "__div_symbol__") c->low = 0.5f;
+    }
+    for (const char* op : {"__add_scalar__", "__sub_scalar__", "__rsub_scalar__",
+                           "__mul_scalar__", "__div_scalar__", "__rpow_scalar__"}) {
+      add(op, {{"scalar", "2"}}, {s}, nullptr);
+    }
+    for (const char* op : {"exp", "log", "sqrt", "relu", "tanh", "softmax"}) {
+      OpCase* c = add(op, {}, {s}, nullptr);
+      if (c->op == "log" || c->op == "sqrt") c->low = 0.1f;
+    }
+    add("equal", {}, {s, s}, nullptr);
+    add("reduce_sum", {{"reduction_indices", "(1,)"}}, {s}, nullptr);
+    add("reduce_mean", {{"reduction_indices", "(1,)"}}, {s}, nullptr);
+    add("reduce_sum", {}, {s}, nullptr);
+    add("_argmax", {{"reduction_indices", "(1,)"}}, {s}, nullptr);
+  }
+  // mnist softmax, mlp hidden layer and a square layer.
+  const std::vector<std::pair<TShape, TShape> > mm_shapes = {
+    {TShape{100, 784}, TShape{784, 10}},
+    {TShape{100, 784}, TShape{784, 100}},
+    {TShape{256, 1024}, TShape{1024, 1024}},
+    {TShape{1024, 1024}, TShape{1024, 1024}}};
+  for (const auto& s : mm_shapes) {
+    add("matmul", {}, {s.first, s.second}, MatMulFlops(0, 1));
+    add("linear", {{"num_hidden", std::to_string(s.second[1])}},
+        {s.first, TShape{s.second[1], s.second[0]}}, MatMulFlops(0, 1));
+  }
+  // convolutions of mnist_lenet and cifar_resnet.
+  struct ConvShape {
+    TShape data;
+    uint32_t num_filter, ksize;
+    const char* padding;
+  };
+  const std::vector<ConvShape> conv_shapes = {
+    {TShape{64, 1, 28, 28}, 20, 5, "VALID"},
+    {TShape{64, 20, 12, 12}, 50, 5, "VALID"},
+    {TShape{64, 3, 32, 32}, 16, 5, "SAME"},
+    {TShape{64, 16, 32, 32}, 16, 3, "SAME"},
+    {TShape{64, 64, 8, 8}, 64, 3, "SAME"}};
+  for (const ConvShape& s : conv_shapes) {
+    std::string k = std::to_string(s.ksize);
+    add("conv2d", {{"ksize", "(1," + k + "," + k + ",1)"},
+                   {"num_filter", std::to_string(s.num_filter)},
+                   {"padding", s.padding}, {"data_format", "NCHW"}},
+        {s.data, TShape{s.num_filter, s.data[1], s.ksize, s.ksize}}, ConvFlops);
+  }
+  const std::vector<TShape> pool_shapes = {
+    TShape{64, 20, 24, 24}, TShape{64, 16, 32, 32}};
+  for (const TShape& s : pool_shapes) {
+    for (const char* op : {"max_pool", "avg_pool"}) {
+      add(op, {{"ksize", "(1,2,2,1)"}, {"strides", "(1,2,2,1)"},
+               {"padding", "VALID"}, {"data_format", "NCHW"}}, {s}, nullptr);
+    }
+  }
+  const std::vector<TShape> bn_shapes = {
+    TShape{64, 16, 32, 32}, TShape{64, 64, 8, 8}};
+  for (const TShape& s : bn_shapes) {
+    add("batch_normalization", {}, {s, TShape{s[1]}, TShape{s[1]}}, nullptr);
+    add("flatten_layer", {}, {s}, nullptr);
+    add("pad", {{"dim", "3"}, {"pad", "2"}}, {s}, nullptr);
+  }
+  const std::vector<TShape> logit_shapes = {TShape{100, 10}, TShape{256, 1000}};
+  for (const TShape& s : logit_shapes) {
+    OpCase* c = add("mean_sparse_softmax_cross_entropy_with_logits", {},
+                    {s, TShape{s[0]}}, nullptr);
+    c->label_input = 1;
+    c->num_class = static_cast<int>(s[1]);
+  }
+  return cases;
+}
+
+// the input shapes of a case, comma separated.
+std::string ShapeString(const OpCase& c) {
+  std::ostringstream os;
+  for (size_t i = 0; i < c.shapes.size(); ++i) {
+    if (i != 0) os << ',';
+    os << c.shapes[i];
+  }
+  return os.str();
+}
+
+// run one case until min_time seconds elapse.
+OpResult RunCase(Session* sess, const OpCase& c, double min_time) {
+  std::vector<nnvm::Symbol> inputs(c.shapes.size());
+  std::vector<const nnvm::Symbol*> args;
+  std::vector<std::vector<float> > data(c.shapes.size());
+  std::unordered_map<std::string, TBlob> feed;
+  std::mt19937 rng(0);
+  for (size_t i = 0; i < c.shapes.size(); ++i) {
+    std::string name = "in" + std::to_string(i);
+    inputs[i] = nnvm::Symbol::CreateFunctor(Op::Get("placeholder"), {});
+    inputs[i].Compose({}, {}, name);
+    args.push_back(&inputs[i]);
+    data[i].resize(c.shapes[i].Size());
+    if (static_cast<int>(i) == c.label_input) {
+      std::uniform_int_distribution<int> dist(0, c.num_class - 1);
+      for (float& v : data[i]) v = static_cast<float>(dist(rng));
+    } else {
+      std::uniform_real_distribution<float> dist(c.low, c.high);
+      for (float& v : data[i]) v = dist(rng);
+    }
+    TBlob blob;
+    blob.data = dmlc::BeginPtr(data[i]);
+    blob.shape = c.shapes[i];
+    feed[name] = blob;
+  }
+  nnvm::Symbol sym = nnvm::Symbol::CreateFunctor(Op::Get(c.op), c.attrs);
+  sym.Compose(args, {}, "op");
+
+  OpResult ret;
+  ret.op = c.op;
+  ret.attrs.insert(c.attrs.begin(), c.attrs.end());
+  ret.shape = ShapeString(c);
+  // the first runs set up the executor.
+  TShape out_shape;
+  for (int i = 0; i < 3; ++i) {
+    out_shape = sess->Run(&sym, feed)[0].shape;
+  }
+  sess->GetProfile(true);
+  auto begin = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  while (elapsed < min_time || ret.iters < 10) {
+    sess->Run(&sym, feed);
+    ++ret.iters;
+    elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+  }
+  ret.run_us = elapsed * 1e6 / ret.iters;
+  // {"nodes": {name: {"count", "total_us", "max_us"}}, ...}
+  std::map<std::string, std::map<std::string, std::map<std::string, double> > > prof;
+  std::istringstream is(sess->GetProfile(true));
+  dmlc::JSONReader reader(&is);
+  reader.Read(&prof);
+  auto& stat = prof["nodes"]["op"];
+  ret.kernel_us = (stat["count"] != 0 ? stat["total_us"] / stat["count"] : 0);
+  double seconds = (ret.kernel_us != 0 ? ret.kernel_us : ret.run_us) * 1e-6;
+  if (c.flops) {
+    ret.gflops = c.flops(c.shapes, out_shape) / seconds * 1e-9;
+  } else {
+    double bytes = out_shape.Size() * sizeof(float);
+    for (const TShape& s : c.shapes) bytes += s.Size() * sizeof(float);
+    ret.gbps = bytes / seconds * 1e-9;
+  }
+  return ret;
+}
+
+}  // namespace bench
+}  // namespace tinyflow
+
+int main(int argc, char *argv[]) {
+  using namespace tinyflow;
+  std::map<std::string, std::string> opts = {
+    {"device", "cpu"}, {"filter", ""}, {"min_time", "0.2"}, {"out", ""}};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    CHECK(eq != std::string::npos && opts.count(arg.substr(0, eq)))
+        << "unknown argument " << arg;
+    opts[arg.substr(0, eq)] = arg.substr(eq + 1);
+  }
+  double min_time = std::stod(opts["min_time"]);
+  std::unique_ptr<Session> sess(Session::Create(opts["device"] + ",profile"));
+  std::vector<bench::OpResult> results;
+  for (const bench::OpCase& c : bench::MakeCases()) {
+    if (opts["filter"].length() != 0 && c.op != opts["filter"]) continue;
+    try {
+      results.push_back(bench::RunCase(sess.get(), c, min_time));
+    } catch (const std::exception& e) {
+      // report the failure and go on with the other cases.
+      bench::OpResult r;
+      r.op = c.op;
+      r.attrs.insert(c.attrs.begin(), c.attrs.end());
+      r.shape = bench::ShapeString(c);
+      r.error = e.what();
+      results.push_back(r);
+      LOG(WARNING) << r.op << ' ' << r.shape << " failed: " << r.error;
+      continue;
+    }
+    LOG(INFO) << results.back().op << ' ' << results.back().shape
+              << ": " << results.back().kernel_us << " us";
+  }
+  std::ofstream fout;
+  if (opts["out"].length() != 0) {
+    fout.open(opts["out"].c_str());
+    CHECK(fout.good()) << "cannot open " << opts["out"];
+  }
+  std::ostream& os = (fout.is_open() ? static_cast<std::ostream&>(fout) : std::cout);
+  dmlc::JSONWriter writer(&os);
+  writer.BeginObject();
+  writer.WriteObjectKeyValue("device", opts["device"]);
+  writer.WriteObjectKeyValue("min_time", min_time);
+  writer.WriteObjectKeyValue("results", results);
+  writer.EndObject();
+  os << std::endl;
+  return 0;
+}
@@ -0,0 +1,236 @@
+// Copyright (c) 2016 by Contributors
+// per-call overhead of running tiny graphs, where kernel time is negligible.
+// Usage: overhead_bench [calls=N] [repeat=N] [out=file]
+// Reports ns per call of feed map construction, NNSessionRun, Session::Run,
+// Session::Run into output buffers, and the Setup/RunOps/CopyOutputs
+// phases measured by the session profiler.
+#include <tinyflow/base.h>
+#include <tinyflow/c_api.h>
+#include <dmlc/json.h>
+#include <dmlc/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tinyflow {
+namespace bench {
+
+// a graph with its placeholders.
+struct TinyGraph {
+  std::string name;
+  nnvm::Symbol symbol;
+  std::vector<nnvm::Symbol> placeholders;
+  std::vector<TShape> shapes;
+  // assigns to initialize the variables.
+  std::vector<nnvm::Symbol> init;
+  size_t num_ops{0};
+};
+
+struct OverheadResult {
+  std::string graph;
+  size_t num_ops{0};
+  std::map<std::string, double> ns_per_call;
+  inline void Save(dmlc::JSONWriter* writer) const {
+    writer->BeginObject();
+    writer->WriteObjectKeyValue("graph", graph);
+    writer->WriteObjectKeyValue("num_ops", num_ops);
+    writer->WriteObjectKeyValue("ns_per_call", ns_per_call);
+    writer->EndObject();
+  }
+};
+
+inline nnvm::Symbol Apply(const std::string& op,
+                          std::unordered_map<std::string, std::string> attrs,
+                          std::vector<const nnvm::Symbol*> args,
+                          const std::string& name) {
+  nnvm::Symbol s = nnvm::Symbol::CreateFunctor(Op::Get(op), std::move(attrs));
+  s.Compose(args, {}, name);
+  return s;
+}
+
+std::vector<TinyGraph> MakeGraphs() {
+  std::vector<TinyGraph> graphs;
+  TinyGraph g;
+  // fetch the placeholder itself, only copy in and out.
+  g.name = "noop";
+  g.placeholders = {Apply("placeholder", {}, {}, "x")};
+  g.shapes = {TShape{1, 16}};
+  g.symbol = g.placeholders[0];
+  graphs.push_back(g);
+
+  g = TinyGraph();
+  g.name = "add";
+  g.placeholders = {Apply("placeholder", {}, {}, "x")};
+  g.shapes = {TShape{1, 16}};
+  g.symbol = Apply("__add_scalar__", {{"scalar", "1"}}, {&g.placeholders[0]}, "add");
+  g.num_ops = 1;
+  graphs.push_back(g);
+
+  g = TinyGraph();
+  g.name = "mlp10";
+  g.placeholders = {Apply("placeholder", {}, {}, "x")};
+  g.shapes = {TShape{1, 16}};
+  nnvm::Symbol h = g.placeholders[0];
+  for (int i = 0; i < 10; ++i) {
+    std::string id = std::to_string(i);
+    nnvm::Symbol w = nnvm::Symbol::CreateVariable("w" + id);
+    nnvm::Symbol init = Apply("normal", {{"shape", "(16,16)"}}, {}, "init" + id);
+    g.init.push_back(Apply("assign", {}, {&w, &init}, "assign" + id));
+    nnvm::Symbol fc = Apply("linear", {{"num_hidden", "16"}}, {&h, &w}, "fc" + id);
+    h = Apply("relu", {}, {&fc}, "relu" + id);
+  }
+  g.symbol = h;
+  g.num_ops = 20;
+  graphs.push_back(g);
+  return graphs;
+}
+
+// median over repeats of the mean ns per call of calls runs of f.
+double TimeNs(size_t calls, size_t repeat, const std::function<void()>& f) {
+  std::vector<double> samples;
+  for (size_t r = 0; r < repeat; ++r) {
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) f();
+    samples.push_back(std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - begin).count() / calls);
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+OverheadResult RunGraph(TinyGraph* g, size_t calls, size_t repeat) {
+  OverheadResult ret;
+  ret.graph = g->name;
+  ret.num_ops = g->num_ops;
+  std::vector<std::vector<float> > data;
+  std::vector<const float*> feed_dptr;
+  std::vector<nn_uint> feed_dtype, feed_csr = {0}, feed_shape;
+  std::vector<SymbolHandle> feed_handles;
+  for (size_t i = 0; i < g->placeholders.size(); ++i) {
+    data.emplace_back(g->shapes[i].Size(), 1.0f);
+    feed_dptr.push_back(dmlc::BeginPtr(data.back()));
+    feed_dtype.push_back(kFloat32);
+    for (size_t k = 0; k < g->shapes[i].ndim(); ++k) {
+      feed_shape.push_back(g->shapes[i][k]);
+    }
+    feed_csr.push_back(static_cast<nn_uint>(feed_shape.size()));
+    feed_handles.push_back(&(g->placeholders[i]));
+  }
+  // the feed dict as the C API builds it.
+  auto make_feed = [&]() {
+    std::unordered_map<std::string, TBlob> feed;
+    for (size_t i = 0; i < g->placeholders.size(); ++i) {
+      const std::string& key = g->placeholders[i].outputs[0].node->attrs.name;
+      TBlob blob;
+      blob.data = data[i].data();
+      blob.shape = TShape(feed_shape.begin() + feed_csr[i],
+                          feed_shape.begin() + feed_csr[i + 1]);
+      feed[key] = blob;
+    }
+    return feed;
+  };
+  std::unordered_map<std::string, TBlob> feed = make_feed();
+
+  for (const char* config : {"cpu", "cpu,profile"}) {
+    std::unique_ptr<Session> sess(Session::Create(config));
+    for (nnvm::Symbol& init : g->init) sess->Run(&init, {});
+    // set up the executor.
+    const std::vector<TBlob>& out = sess->Run(&(g->symbol), feed);
+    std::vector<std::vector<float> > out_data;
+    std::vector<TBlob> out_buffers;
+    for (const TBlob& blob : out) {
+      out_data.emplace_back(blob.shape.Size());
+    }
+    for (size_t i = 0; i < out.size(); ++i) {
+      TBlob blob = out[i];
+      blob.data = dmlc::BeginPtr(out_data[i]);
+      out_buffers.push_back(blob);
+    }
+    if (std::string(config) == "cpu") {
+      ret.ns_per_call["feed_map"] = TimeNs(calls, repeat, [&]() { make_feed(); });
+      ret.ns_per_call["session_run"] = TimeNs(calls, repeat, [&]() {
+          sess->Run(&(g->symbol), feed);
+        });
+      ret.ns_per_call["session_run_into"] = TimeNs(calls, repeat, [&]() {
+          sess->Run(&(g->symbol), feed, out_buffers);
+        });
+      ret.ns_per_call["c_api_run"] = TimeNs(calls, repeat, [&]() {
+          nn_uint num_out;
+          const float** out_dptr;
+          const nn_uint *out_dtype, *out_ndim;
+          const nn_uint** out_shape;
+          CHECK_EQ(NNSessionRun(sess.get(), &(g->symbol),
+                                static_cast<nn_uint>(feed_handles.size()),
+                                dmlc::BeginPtr(feed_handles), dmlc::BeginPtr(feed_dptr),
+                                dmlc::BeginPtr(feed_dtype), dmlc::BeginPtr(feed_csr),
+                                dmlc::BeginPtr(feed_shape), &num_out, &out_dptr,
+                                &out_dtype, &out_ndim, &out_shape), 0);
+        });
+    } else {
+      sess->GetProfile(true);
+      for (size_t i = 0; i < calls; ++i) sess->Run(&(g->symbol), feed);
+      // {"phases": {name: {"count", "total_us", "max_us"}}, ...}
+      std::map<std::string, std::map<std::string, std::map<std::string, double> > > prof;
+      std::istringstream is(sess->GetProfile(true));
+      dmlc::JSONReader reader(&is);
+      reader.Read(&prof);
+      for (const char* phase : {"Setup", "RunOps", "CopyOutputs"}) {
+        ret.ns_per_call[std::string("profiled_") + phase] =
+            prof["phases"][phase]["total_us"] * 1e3 / calls;
+      }
+      double kernel_us = 0;
+      for (auto& kv : prof["nodes"]) kernel_us += kv.second["total_us"];
+      ret.ns_per_call["profiled_op_closures"] = kernel_us * 1e3 / calls;
+      if (g->num_ops != 0) {
+        ret.ns_per_call["profiled_per_op"] =
+            prof["phases"]["RunOps"]["total_us"] * 1e3 / calls / g->num_ops;
+      }
+    }
+  }
+  return ret;
+}
+
+}  // namespace bench
+}  // namespace tinyflow
+
+int main(int argc, char *argv[]) {
+  using namespace tinyflow;
+  std::map<std::string, std::string> opts = {
+    {"calls", "10000"}, {"repeat", "5"}, {"out", ""}};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    CHECK(eq != std::string::npos && opts.count(arg.substr(0, eq)))
+        << "unknown argument " << arg;
+    opts[arg.substr(0, eq)] = arg.substr(eq + 1);
+  }
+  size_t calls = std::stoul(opts["calls"]);
+  size_t repeat = std::max(std::stoul(opts["repeat"]), static_cast<size_t>(1));
+  std::vector<bench::OverheadResult> results;
+  for (bench::TinyGraph& g : bench::MakeGraphs()) {
+    results.push_back(bench::RunGraph(&g, calls, repeat));
+    LOG(INFO) << g.name << ": " << results.back().ns_per_call["session_run"]
+              << " ns per Session::Run";
+  }
+  std::ofstream fout;
+  if (opts["out"].length() != 0) {
+    fout.open(opts["out"].c_str());
+    CHECK(fout.good()) << "cannot open " << opts["out"];
+  }
+  std::ostream& os = (fout.is_open() ? static_cast<std::ostream&>(fout) : std::cout);
+  dmlc::JSONWriter writer(&os);
+  writer.BeginObject();
+  writer.WriteObjectKeyValue("calls", calls);
+  writer.WriteObjectKeyValue("results", results);
+  writer.EndObject();
+  os << std::endl;
+  return 0;
+}
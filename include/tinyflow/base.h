@@ -13,6 +13,8 @@
 #include <nnvm/symbolic.h>
 #include <vector>
 #include <string>
+#include <functional>
+#include <future>
 
 namespace tinyflow {
 
@@ -76,6 +78,27 @@ using FLuaCompute = std::string;
  */
 using FLuaCreateNNModule = std::string;
 
+/*!
+ * \brief a native function to return closure to carry out computation of an op on CPU.
+ *
+ *  Signature:
+ *  function(attrs, inputs, outputs)
+ *  - attrs: the attributes of the node.
+ *  - inputs: array of pointers to input TBlob
+ *  - outputs: array of pointers to output TBlob
+ *  - return: a closure, with signature void() that carrys out the computation.
+ *
+ *  The TBlob pointers stay valid during the lifetime of the closure,
+ *  but the executor can change the content they point to between calls,
+ *  so the closure should read data and shape when it is called.
+ * \note Register as FCompute,
+ *  takes precedence over FLuaCompute/FLuaCreateNNModule on CPU.
+ */
+using FCompute = std::function<std::function<void()>(
+    const nnvm::NodeAttrs& attrs,
+    const std::vector<const TBlob*>& inputs,
+    const std::vector<const TBlob*>& outputs)>;
+
 /*!
  * \brief If registered and TBackwardNumNoGrad=k
  *  The last k inputs do not have gradient.
@@ -95,6 +118,27 @@ using TBackwardNeedInputs = bool;
  */
 using TBackwardNeedOutputs = bool;
 
+/*!
+ * \brief Whether the op carries out no computation,
+ *  the executor does not create or run a closure for it.
+ * \note Register as TNoCompute
+ */
+using TNoCompute = bool;
+
+/*! \brief outputs of an asynchronous run, owns the memory of the outputs. */
+struct RunResult {
+  /*! \brief the output tensors, data points into buffers */
+  std::vector<TBlob> outputs;
+  /*! \brief memory of the outputs */
+  std::vector<std::vector<float> > buffers;
+  RunResult() = default;
+  RunResult(RunResult&&) = default;
+  RunResult& operator=(RunResult&&) = default;
+  // copy would leave outputs pointing to the buffers of the source.
+  RunResult(const RunResult&) = delete;
+  RunResult& operator=(const RunResult&) = delete;
+};
+
 /*! \brief Executor of a graph */
 class Session {
  public:
@@ -109,6 +153,63 @@ class Session {
   virtual const std::vector<TBlob>& Run(
       Symbol* g,
       const std::unordered_map<std::string, TBlob>& inputs) = 0;
+  /*!
+   * \brief Run the given graph, write the outputs into given buffers.
+   * \param g the graph to run.
+   * \param inputs The input feed_dict mapping
+   * \param outputs The cpu buffers to hold the outputs,
+   *  the size of each buffer must match the size of the corresponding output.
+   * \return The output tensors, whose data points to the given buffers.
+   */
+  virtual const std::vector<TBlob>& Run(
+      Symbol* g,
+      const std::unordered_map<std::string, TBlob>& inputs,
+      const std::vector<TBlob>& outputs) = 0;
+  /*!
+   * \brief Submit the given graph to run in background.
+   *  Runs are carried out one at a time in the order of submission,
+   *  a synchronous Run waits for all the submitted runs to finish first.
+   * \param g the graph to run.
+   * \param inputs The input feed_dict mapping, the data is copied
+   *  before the function returns.
+   * \return future of the outputs.
+   */
+  virtual std::future<RunResult> RunAsync(
+      Symbol* g,
+      const std::unordered_map<std::string, TBlob>& inputs) = 0;
+  /*!
+   * \brief Save all the variables of the session into a checkpoint file.
+   * \param fname The file name.
+   */
+  virtual void Save(const std::string& fname) = 0;
+  /*!
+   * \brief Restore the variables from a checkpoint file.
+   *  On cpu, the variables are backed by the memory mapped file,
+   *  pages are only copied when written.
+   * \param fname The file name.
+   */
+  virtual void Load(const std::string& fname) = 0;
+  /*!
+   * \brief Get the time spent in operators and executor setup phases,
+   *  only available when the session is created with option profile.
+   * \param reset Whether to clear the records after returning them.
+   * \return json object, ops and nodes map op names and node names,
+   *  phases map setup phases to {count, total_us, max_us}.
+   */
+  virtual std::string GetProfile(bool reset) = 0;
+  /*!
+   * \brief Write the timeline of the runs in chrome trace event format,
+   *  only available when the session is created with option trace.
+   *  The events are cleared after written.
+   * \param fname The file name.
+   */
+  virtual void DumpTrace(const std::string& fname) = 0;
+  /*!
+   * \brief Get the memory used by the session.
+   * \return json object with bytes of each variable, the activation pools,
+   *  output staging buffers and the planned peak, in total and per executor.
+   */
+  virtual std::string GetMemoryReport() = 0;
   /*! \brief virtual destructor */
   virtual ~Session() {}
   /*!
@@ -119,6 +220,56 @@ class Session {
   static Session* Create(const std::string& type);
 };
 
+/*!
+ * \brief Batch concurrent requests on one graph into a single run.
+ *  The inputs of the requests are concatenated along dimension 0,
+ *  the outputs are sliced along dimension 0 and returned to each request.
+ *  Batches have the rows of their requests only, create the session with
+ *  option max_batch of at least the max_batch of the batcher, so batches
+ *  of every size run in the views of one plan.
+ */
+class Batcher {
+ public:
+  /*! \brief statistics of the batcher */
+  struct Stats {
+    /*! \brief number of requests waiting to be batched */
+    size_t queue_depth{0};
+    /*! \brief number of requests served */
+    size_t num_requests{0};
+    /*! \brief number of batches run */
+    size_t num_batches{0};
+    /*! \brief total rows of the batches run */
+    size_t num_rows{0};
+    /*! \brief rows of the last batch */
+    size_t last_batch_size{0};
+    /*! \brief maximum rows of a batch run */
+    size_t max_batch_size{0};
+  };
+  /*!
+   * \brief Run a request, blocks until the batch it joins finishes.
+   *  Can be called concurrently from different threads.
+   * \param inputs The input feed_dict mapping,
+   *  all inputs must have the same dimension 0.
+   * \return the outputs of this request.
+   */
+  virtual RunResult Run(const std::unordered_map<std::string, TBlob>& inputs) = 0;
+  /*! \return the statistics of the batcher. */
+  virtual Stats GetStats() = 0;
+  /*! \brief virtual destructor */
+  virtual ~Batcher() {}
+  /*!
+   * \brief create a batcher of given graph.
+   * \param sess The session to run the batches, must outlive the batcher.
+   * \param g The graph to run.
+   * \param max_batch Maximum rows of a batch.
+   * \param timeout_us Maximum time in microseconds the first request
+   *  of a batch waits for others to join.
+   * \return a new created batcher.
+   */
+  static Batcher* Create(Session* sess, Symbol* g,
+                         size_t max_batch, int64_t timeout_us);
+};
+
 }  // namespace tinyflow
 
 #endif  // TINYFLOW_BASE_H_
@@ -9,11 +9,36 @@
 #include <nnvm/c_api.h>
 
 typedef void* SessionHandle;
+/*! \brief handle to a submitted asynchronous run */
+typedef void* RunHandle;
+/*! \brief handle to a request batcher */
+typedef void* BatcherHandle;
 
 NNVM_DLL int NNSessionCreate(SessionHandle* handle, const char* option);
 
 NNVM_DLL int NNSessionClose(SessionHandle handle);
 
+NNVM_DLL int NNSessionSave(SessionHandle handle, const char* fname);
+
+NNVM_DLL int NNSessionLoad(SessionHandle handle, const char* fname);
+
+/*!
+ * \brief get the profile of a session created with option profile.
+ * \param handle The session.
+ * \param reset Whether to clear the records.
+ * \param out_json The profile as a json object, valid until next call in the thread.
+ */
+NNVM_DLL int NNSessionGetProfile(SessionHandle handle, int reset, const char** out_json);
+
+NNVM_DLL int NNSessionDumpTrace(SessionHandle handle, const char* fname);
+
+/*!
+ * \brief get the memory used by a session.
+ * \param handle The session.
+ * \param out_json The report as a json object, valid until next call in the thread.
+ */
+NNVM_DLL int NNSessionGetMemoryReport(SessionHandle handle, const char** out_json);
+
 NNVM_DLL int NNSessionRun(SessionHandle handle,
                           SymbolHandle graph,
                           nn_uint num_feed,
@@ -28,4 +53,65 @@ NNVM_DLL int NNSessionRun(SessionHandle handle,
                           const nn_uint **out_shape_ndim,
                           const nn_uint ***out_shape_data);
 
+NNVM_DLL int NNSessionRunInto(SessionHandle handle,
+                              SymbolHandle graph,
+                              nn_uint num_feed,
+                              const SymbolHandle* feed_placeholders,
+                              const float** feed_dptr,
+                              const nn_uint* feed_dtype,
+                              const nn_uint* feed_shape_csr_ptr,
+                              const nn_uint* feed_shape_data,
+                              nn_uint num_out,
+                              float** out_dptr,
+                              const nn_uint* out_size);
+
+NNVM_DLL int NNSessionRunAsync(SessionHandle handle,
+                               SymbolHandle graph,
+                               nn_uint num_feed,
+                               const SymbolHandle* feed_placeholders,
+                               const float** feed_dptr,
+                               const nn_uint* feed_dtype,
+                               const nn_uint* feed_shape_csr_ptr,
+                               const nn_uint* feed_shape_data,
+                               RunHandle* out);
+
+NNVM_DLL int NNRunWait(RunHandle handle,
+                       nn_uint* num_out,
+                       const float*** out_dptr,
+                       const nn_uint** out_dtype,
+                       const nn_uint **out_shape_ndim,
+                       const nn_uint ***out_shape_data);
+
+NNVM_DLL int NNRunIsReady(RunHandle handle, int* out);
+
+NNVM_DLL int NNRunFree(RunHandle handle);
+
+NNVM_DLL int NNBatcherCreate(SessionHandle session,
+                             SymbolHandle graph,
+                             nn_uint max_batch,
+                             nn_uint timeout_us,
+                             BatcherHandle* out);
+
+NNVM_DLL int NNBatcherFree(BatcherHandle handle);
+
+NNVM_DLL int NNBatcherRun(BatcherHandle handle,
+                          nn_uint num_feed,
+                          const SymbolHandle* feed_placeholders,
+                          const float** feed_dptr,
+                          const nn_uint* feed_dtype,
+                          const nn_uint* feed_shape_csr_ptr,
+                          const nn_uint* feed_shape_data,
+                          nn_uint* num_out,
+                          const float*** out_dptr,
+                          const nn_uint** out_dtype,
+                          const nn_uint **out_shape_ndim,
+                          const nn_uint ***out_shape_data);
+
+/*!
+ * \brief get the statistics of the batcher.
+ * \param handle The batcher.
+ * \param out_stats The statistics as a json object, valid until next call in the thread.
+ */
+NNVM_DLL int NNBatcherGetStats(BatcherHandle handle, const char** out_stats);
+
 #endif  // TINYFLOW_C_API_H_
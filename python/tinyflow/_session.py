@@ -1,10 +1,13 @@
 from __future__ import absolute_import as _abs
 import ctypes as _ctypes
+import json as _json
 import numpy as np
 from nnvm import symbol
 from nnvm._base import c_str, check_call, _LIB, c_array, nn_uint
 
 SessionHandle = _ctypes.c_void_p
+RunHandle = _ctypes.c_void_p
+BatcherHandle = _ctypes.c_void_p
 nn_float = _ctypes.c_float
 
 def _get_numpy(cptr, dtype, shape):
@@ -19,6 +22,145 @@ def _get_numpy(cptr, dtype, shape):
     else:
         return None
 
+def _fetch_outputs(frun):
+    out_size = nn_uint()
+    out_dptr = _ctypes.POINTER(_ctypes.POINTER(nn_float))()
+    out_dtype = _ctypes.POINTER(nn_uint)()
+    out_shape_ndim = _ctypes.POINTER(nn_uint)()
+    out_shape_data = _ctypes.POINTER(_ctypes.POINTER(nn_uint))()
+    check_call(frun(_ctypes.byref(out_size),
+                    _ctypes.byref(out_dptr),
+                    _ctypes.byref(out_dtype),
+                    _ctypes.byref(out_shape_ndim),
+                    _ctypes.byref(out_shape_data)))
+    ret = []
+    for i in range(out_size.value):
+        shape = tuple(out_shape_data[i][:out_shape_ndim[i]])
+        ret.append(_get_numpy(out_dptr[i], out_dtype[i], shape))
+    return ret[0] if len(ret) == 1 else ret
+
+
+class RunFuture(object):
+    """Future of a run submitted by Session.run_async."""
+    def __init__(self, handle):
+        self.handle = handle
+        self._result = None
+
+    def __del__(self):
+        if self.handle is not None:
+            check_call(_LIB.NNRunFree(self.handle))
+
+    def done(self):
+        """Whether the run has finished, does not block."""
+        if self.handle is None:
+            return True
+        ret = _ctypes.c_int()
+        check_call(_LIB.NNRunIsReady(self.handle, _ctypes.byref(ret)))
+        return ret.value != 0
+
+    def result(self):
+        """Wait for the run to finish.
+
+        Returns
+        -------
+        The computed numpy.ndarray, or list of them for multiple outputs.
+        """
+        if self.handle is not None:
+            handle = self.handle
+            try:
+                self._result = _fetch_outputs(
+                    lambda *args: _LIB.NNRunWait(handle, *args))
+            finally:
+                self.handle = None
+                check_call(_LIB.NNRunFree(handle))
+        return self._result
+
+    wait = result
+
+
+def _feed_args(feed_dict):
+    feed_dict = feed_dict if feed_dict else {}
+    feed_placeholders = []
+    feed_dptr = []
+    feed_dtype = []
+    feed_shape_csr_ptr = [0]
+    feed_shape_data = []
+    src_list = []
+
+    for k, v in feed_dict.items():
+        assert isinstance(k, symbol.Symbol)
+        assert isinstance(v, np.ndarray)
+        feed_placeholders.append(k.handle)
+        # only convert to float32 for now
+        source_array = np.ascontiguousarray(v, dtype=np.float32)
+        # leep src_list alive for the period
+        src_list.append(source_array)
+        feed_dptr.append(source_array.ctypes.data_as(_ctypes.c_void_p))
+        feed_dtype.append(0)
+        feed_shape_data.extend(source_array.shape)
+        feed_shape_csr_ptr.append(len(feed_shape_data))
+    feed_args = (
+        nn_uint(len(src_list)),
+        c_array(_ctypes.c_void_p, feed_placeholders),
+        c_array(_ctypes.c_void_p, feed_dptr),
+        c_array(nn_uint, feed_dtype),
+        c_array(nn_uint, feed_shape_csr_ptr),
+        c_array(nn_uint, feed_shape_data))
+    return feed_args, src_list
+
+
+class Batcher(object):
+    """Batch concurrent requests on a graph into one run.
+
+    Created by Session.batcher. run can be called from many threads,
+    the feeds are concatenated along dimension 0 and each call
+    gets its own slice of the outputs.
+    """
+    def __init__(self, session, fetch, max_batch, timeout_ms):
+        if isinstance(fetch, list):
+            fetch = symbol.Group(fetch)
+        handle = BatcherHandle()
+        check_call(_LIB.NNBatcherCreate(
+            session.handle, fetch.handle, nn_uint(max_batch),
+            nn_uint(int(timeout_ms * 1000)), _ctypes.byref(handle)))
+        self.handle = handle
+        # keep the session and graph alive for the batcher.
+        self._session = session
+        self._fetch = fetch
+
+    def __del__(self):
+        check_call(_LIB.NNBatcherFree(self.handle))
+
+    def run(self, feed_dict):
+        """Run a request, blocks until its batch finishes.
+
+        Parameters
+        ----------
+        feed_dict : dict
+            Map from placeholder to numpy.ndarray,
+            all arrays must have the same dimension 0.
+
+        Returns
+        -------
+        The computed numpy.ndarray, or list of them for multiple outputs.
+        """
+        feed_args, src_list = _feed_args(feed_dict)
+        return _fetch_outputs(
+            lambda *args: _LIB.NNBatcherRun(self.handle, *(feed_args + args)))
+
+    def stats(self):
+        """Get the statistics of the batcher.
+
+        Returns
+        -------
+        dict with queue_depth, num_requests, num_batches, num_rows,
+        last_batch_size and max_batch_size.
+        """
+        ret = _ctypes.c_char_p()
+        check_call(_LIB.NNBatcherGetStats(self.handle, _ctypes.byref(ret)))
+        return _json.loads(ret.value.decode('utf-8'))
+
+
 class Session(object):
     def __init__(self, config='cpu'):
         handle = SessionHandle()
@@ -28,50 +170,166 @@ class Session(object):
     def __del__(self):
         check_call(_LIB.NNSessionClose(self.handle))
 
-    def run(self, fetch, feed_dict=None):
+    def save(self, fname):
+        """Save all the variables of the session into a checkpoint file.
+
+        Parameters
+        ----------
+        fname : str
+            The file name.
+        """
+        check_call(_LIB.NNSessionSave(self.handle, c_str(fname)))
+
+    def load(self, fname):
+        """Restore the variables from a checkpoint file saved by save.
+
+        The file is memory mapped, so loading is cheap and the pages
+        are shared by the processes that load the same file.
+
+        Parameters
+        ----------
+        fname : str
+            The file name.
+        """
+        check_call(_LIB.NNSessionLoad(self.handle, c_str(fname)))
+
+    def profile(self, reset=False):
+        """Get the time spent in each operator and executor setup phase.
+
+        Only available when the session is created with option profile,
+        e.g. Session("cpu,profile").
+
+        Parameters
+        ----------
+        reset : bool
+            Whether to clear the records.
+
+        Returns
+        -------
+        dict with ops, nodes and phases, each maps a name to
+        dict of count, total_us and max_us.
+        """
+        ret = _ctypes.c_char_p()
+        check_call(_LIB.NNSessionGetProfile(
+            self.handle, _ctypes.c_int(int(reset)), _ctypes.byref(ret)))
+        return _json.loads(ret.value.decode('utf-8'))
+
+    def dump_trace(self, fname):
+        """Write the timeline of the runs as chrome trace events.
+
+        Only available when the session is created with option trace,
+        e.g. Session("cpu,trace"). Open the file in chrome://tracing.
+        The recorded events are cleared.
+
+        Parameters
+        ----------
+        fname : str
+            The file name.
+        """
+        check_call(_LIB.NNSessionDumpTrace(self.handle, c_str(fname)))
+
+    def memory_report(self):
+        """Get the memory used by the session.
+
+        Returns
+        -------
+        dict with bytes of each variable (variables, variable_bytes),
+        activations (arena_bytes, activation_bytes), output staging
+        buffers (output_bytes), planned_peak_bytes and total_bytes,
+        the details of each executor in executors, and the process wide
+        usage of the cpu storage allocator in storage_arena.
+        """
+        ret = _ctypes.c_char_p()
+        check_call(_LIB.NNSessionGetMemoryReport(self.handle, _ctypes.byref(ret)))
+        return _json.loads(ret.value.decode('utf-8'))
+
+    def batcher(self, fetch, max_batch=32, timeout_ms=1.0):
+        """Create a batcher to serve concurrent requests on fetch.
+
+        Parameters
+        ----------
+        fetch : Symbol or list of Symbol
+            The outputs to be computed, must be batched along dimension 0.
+
+        max_batch : int
+            Maximum rows of a batch. Create the session with option
+            max_batch of at least this value, so batches of every size
+            run in the same plan.
+
+        timeout_ms : float
+            Maximum time the first request of a batch waits for others.
+
+        Returns
+        -------
+        Batcher
+        """
+        return Batcher(self, fetch, max_batch, timeout_ms)
+
+    def run_async(self, fetch, feed_dict=None):
+        """Submit the fetch graph to run in background.
+
+        The feed data is copied before the call returns, so the caller can
+        prepare the next batch while the current one is running.
+        Submitted runs are carried out in order, run waits for all of them.
+
+        Parameters
+        ----------
+        fetch : Symbol or list of Symbol
+            The outputs to be computed.
+
+        feed_dict : dict
+            Map from placeholder to numpy.ndarray.
+
+        Returns
+        -------
+        RunFuture, whose result() returns what run would return.
+        """
+        if isinstance(fetch, list):
+            fetch = symbol.Group(fetch)
+        feed_args, src_list = _feed_args(feed_dict)
+        handle = RunHandle()
+        check_call(_LIB.NNSessionRunAsync(
+            self.handle, fetch.handle, *(feed_args + (_ctypes.byref(handle),))))
+        return RunFuture(handle)
+
+    def run(self, fetch, feed_dict=None, out=None):
+        """Run the fetch graph.
+
+        Parameters
+        ----------
+        fetch : Symbol or list of Symbol
+            The outputs to be computed.
+
+        feed_dict : dict
+            Map from placeholder to numpy.ndarray.
+
+        out : numpy.ndarray or list of numpy.ndarray, optional
+            Float32 contiguous buffers to write the outputs into,
+            avoids copying the results into newly allocated arrays.
+
+        Returns
+        -------
+        The computed numpy.ndarray, or list of them for multiple outputs.
+        When out is given, out is returned.
+        """
         if isinstance(fetch, list):
             fetch = symbol.Group(fetch)
-        feed_dict = feed_dict if feed_dict else {}
-        feed_placeholders = []
-        feed_dptr = []
-        feed_dtype = []
-        feed_shape_csr_ptr = [0]
-        feed_shape_data = []
-        src_list = []
-
-        for k, v in feed_dict.items():
-            assert isinstance(k, symbol.Symbol)
-            assert isinstance(v, np.ndarray)
-            feed_placeholders.append(k.handle)
-            # only convert to float32 for now
-            source_array = np.ascontiguousarray(v, dtype=np.float32)
-            # leep src_list alive for the period
-            src_list.append(source_array)
-            feed_dptr.append(source_array.ctypes.data_as(_ctypes.c_void_p))
-            feed_dtype.append(0)
-            feed_shape_data.extend(source_array.shape)
-            feed_shape_csr_ptr.append(len(feed_shape_data))
-        out_size = nn_uint()
-        out_dptr = _ctypes.POINTER(_ctypes.POINTER(nn_float))()
-        out_dtype = _ctypes.POINTER(nn_uint)()
-        out_shape_ndim = _ctypes.POINTER(nn_uint)()
-        out_shape_data = _ctypes.POINTER(_ctypes.POINTER(nn_uint))()
-
-        check_call(_LIB.NNSessionRun(
-            self.handle, fetch.handle, nn_uint(len(src_list)),
-            c_array(_ctypes.c_void_p, feed_placeholders),
-            c_array(_ctypes.c_void_p, feed_dptr),
-            c_array(nn_uint, feed_dtype),
-            c_array(nn_uint, feed_shape_csr_ptr),
-            c_array(nn_uint, feed_shape_data),
-            _ctypes.byref(out_size),
-            _ctypes.byref(out_dptr),
-            _ctypes.byref(out_dtype),
-            _ctypes.byref(out_shape_ndim),
-            _ctypes.byref(out_shape_data)))
-        ret = []
-        for i in range(out_size.value):
-            shape = tuple(out_shape_data[i][:out_shape_ndim[i]])
-            ret.append(_get_numpy(out_dptr[i], out_dtype[i], shape))
-
-        return ret[0] if len(ret) == 1 else ret
+        feed_args, src_list = _feed_args(feed_dict)
+
+        if out is not None:
+            out_list = out if isinstance(out, (list, tuple)) else [out]
+            for arr in out_list:
+                if (not isinstance(arr, np.ndarray) or arr.dtype != np.float32 or
+                        not arr.flags['C_CONTIGUOUS'] or not arr.flags['WRITEABLE']):
+                    raise ValueError("out must be writeable contiguous float32 numpy.ndarray")
+            check_call(_LIB.NNSessionRunInto(
+                self.handle, fetch.handle, *(feed_args + (
+                    nn_uint(len(out_list)),
+                    c_array(_ctypes.c_void_p,
+                            [arr.ctypes.data_as(_ctypes.c_void_p) for arr in out_list]),
+                    c_array(nn_uint, [arr.size for arr in out_list])))))
+            return out
+
+        return _fetch_outputs(
+            lambda *args: _LIB.NNSessionRun(
+                self.handle, fetch.handle, *(feed_args + args)))
@@ -0,0 +1,276 @@
+// Copyright (c) 2016 by Contributors
+// batch concurrent requests on a graph into one run of the session.
+#include <tinyflow/base.h>
+#include <dmlc/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tinyflow {
+
+using FeedDict = std::unordered_map<std::string, TBlob>;
+
+class BatcherImpl : public Batcher {
+ public:
+  BatcherImpl(Session* sess, nnvm::Symbol* sym,
+              size_t max_batch, int64_t timeout_us)
+      : sess_(sess), symbol_(*sym),
+        max_batch_(std::max(max_batch, static_cast<size_t>(1))),
+        timeout_us_(timeout_us) {}
+  RunResult Run(const FeedDict& inputs) override;
+  Stats GetStats() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  struct Request {
+    const FeedDict* inputs;
+    size_t rows;
+    std::promise<RunResult> result;
+  };
+  // rows of the request, checks all inputs agree on dimension 0.
+  static size_t RequestRows(const FeedDict& inputs);
+  // whether the request can join the pending batch.
+  bool Fits(const Request& req) const;
+  // run the batch and hand the outputs to each request.
+  void RunBatch(const std::vector<Request*>& batch);
+  // shapes of the outputs for the fed shapes, false if not yet known.
+  bool GetOutputShapes(const FeedDict& feed, size_t rows, std::vector<TShape>* shapes);
+  // run the batch into buffers sized by the cached output shapes,
+  // false if the shapes are not known or no longer match.
+  bool RunCached(const FeedDict& feed, size_t rows, RunResult* out);
+  // run the batch, copy the outputs and cache their shapes.
+  void RunUncached(const FeedDict& feed, size_t rows, RunResult* out);
+  // the session
+  Session* sess_;
+  // the graph
+  nnvm::Symbol symbol_;
+  // maximum rows of a batch
+  size_t max_batch_;
+  // time the first request waits for others to join
+  int64_t timeout_us_;
+  // requests of the batch being collected
+  std::vector<Request*> pending_;
+  // total rows of pending_
+  size_t pending_rows_{0};
+  // fed shapes of the last batch and the shapes of its outputs,
+  // dimension 0 is set to 0 so batches of any size share them.
+  std::unordered_map<std::string, TShape> fed_shapes_;
+  std::vector<TShape> out_shapes_;
+  // held by the batches that find the output shapes.
+  std::mutex shape_mutex_;
+  Stats stats_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+size_t BatcherImpl::RequestRows(const FeedDict& inputs) {
+  CHECK_NE(inputs.size(), 0U) << "batched request must have inputs";
+  size_t rows = 0;
+  for (const auto& kv : inputs) {
+    const TBlob& blob = kv.second;
+    CHECK_EQ(blob.dev_mask, kCPU) << "fed data must be on cpu";
+    CHECK_EQ(blob.dtype, kFloat32) << "only float is supported so far";
+    CHECK_NE(blob.shape.ndim(), 0U)
+        << "input " << kv.first << " has no dimension to batch";
+    if (rows == 0) rows = blob.shape[0];
+    CHECK_EQ(static_cast<size_t>(blob.shape[0]), rows)
+        << "inputs of a request must have the same dimension 0";
+  }
+  return rows;
+}
+
+bool BatcherImpl::Fits(const Request& req) const {
+  if (pending_rows_ + req.rows > max_batch_) return false;
+  const FeedDict& head = *(pending_[0]->inputs);
+  if (head.size() != req.inputs->size()) return false;
+  for (const auto& kv : *(req.inputs)) {
+    auto it = head.find(kv.first);
+    if (it == head.end()) return false;
+    const TShape& a = it->second.shape;
+    const TShape& b = kv.second.shape;
+    if (a.ndim() != b.ndim()) return false;
+    for (size_t k = 1; k < a.ndim(); ++k) {
+      if (a[k] != b[k]) return false;
+    }
+  }
+  return true;
+}
+
+RunResult BatcherImpl::Run(const FeedDict& inputs) {
+  Request req;
+  req.inputs = &inputs;
+  req.rows = RequestRows(inputs);
+  std::future<RunResult> ret = req.result.get_future();
+  std::unique_lock<std::mutex> lock(mutex_);
+  ++stats_.queue_depth;
+  cv_.wait(lock, [this, &req]() { return pending_.empty() || Fits(req); });
+  pending_.push_back(&req);
+  pending_rows_ += req.rows;
+  if (pending_.size() == 1) {
+    // the first request collects the batch and runs it.
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(timeout_us_);
+    cv_.wait_until(lock, deadline, [this]() { return pending_rows_ >= max_batch_; });
+    std::vector<Request*> batch;
+    batch.swap(pending_);
+    pending_rows_ = 0;
+    stats_.queue_depth -= batch.size();
+    lock.unlock();
+    // requests waiting can start the next batch, which overlaps with this one.
+    cv_.notify_all();
+    RunBatch(batch);
+  } else {
+    if (pending_rows_ >= max_batch_) cv_.notify_all();
+    lock.unlock();
+  }
+  return ret.get();
+}
+
+// shape with dimension 0 set to rows.
+inline TShape WithRows(TShape shape, size_t rows) {
+  shape[0] = rows;
+  return shape;
+}
+
+bool BatcherImpl::GetOutputShapes(const FeedDict& feed, size_t rows,
+                                  std::vector<TShape>* shapes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (fed_shapes_.size() != feed.size()) return false;
+  for (const auto& kv : feed) {
+    auto it = fed_shapes_.find(kv.first);
+    if (it == fed_shapes_.end() || it->second != WithRows(kv.second.shape, 0)) {
+      return false;
+    }
+  }
+  shapes->clear();
+  for (const TShape& shape : out_shapes_) {
+    shapes->push_back(WithRows(shape, rows));
+  }
+  return true;
+}
+
+bool BatcherImpl::RunCached(const FeedDict& feed, size_t rows, RunResult* out) {
+  std::vector<TShape> out_shapes;
+  if (!GetOutputShapes(feed, rows, &out_shapes)) return false;
+  out->buffers.resize(out_shapes.size());
+  out->outputs.clear();
+  for (size_t i = 0; i < out_shapes.size(); ++i) {
+    out->buffers[i].resize(out_shapes[i].Size());
+    TBlob blob;
+    blob.data = dmlc::BeginPtr(out->buffers[i]);
+    blob.shape = out_shapes[i];
+    out->outputs.push_back(blob);
+  }
+  try {
+    out->outputs = sess_->Run(&symbol_, feed, out->outputs);
+  } catch (const dmlc::Error&) {
+    // the output sizes are checked before the graph runs, they change
+    // when a variable is reshaped, e.g. by Load, the shapes are refreshed.
+    std::lock_guard<std::mutex> lock(mutex_);
+    fed_shapes_.clear();
+    out_shapes_.clear();
+    return false;
+  }
+  return true;
+}
+
+void BatcherImpl::RunUncached(const FeedDict& feed, size_t rows, RunResult* out) {
+  // the outputs of the session are only valid until its next run,
+  // they are copied before another batch can run with new shapes.
+  std::lock_guard<std::mutex> run_lock(shape_mutex_);
+  const std::vector<TBlob>& ret = sess_->Run(&symbol_, feed);
+  std::vector<TShape> out_shapes;
+  out->buffers.resize(ret.size());
+  out->outputs.clear();
+  for (size_t i = 0; i < ret.size(); ++i) {
+    TBlob blob = ret[i];
+    CHECK(blob.shape.ndim() != 0 && static_cast<size_t>(blob.shape[0]) == rows)
+        << "outputs of a batched graph must have dimension 0 equal to the batch size";
+    const float* src = static_cast<const float*>(blob.data);
+    out->buffers[i].assign(src, src + blob.shape.Size());
+    blob.data = dmlc::BeginPtr(out->buffers[i]);
+    out->outputs.push_back(blob);
+    out_shapes.push_back(WithRows(blob.shape, 0));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  fed_shapes_.clear();
+  for (const auto& kv : feed) fed_shapes_[kv.first] = WithRows(kv.second.shape, 0);
+  out_shapes_ = out_shapes;
+}
+
+void BatcherImpl::RunBatch(const std::vector<Request*>& batch) {
+  try {
+    size_t total = 0;
+    for (Request* req : batch) total += req->rows;
+    // concatenate the inputs along dimension 0.
+    FeedDict feed;
+    std::vector<std::vector<float> > feed_data;
+    feed_data.reserve(batch[0]->inputs->size());
+    for (const auto& kv : *(batch[0]->inputs)) {
+      TBlob blob = kv.second;
+      blob.shape[0] = total;
+      feed_data.emplace_back(blob.shape.Size());
+      float* dptr = dmlc::BeginPtr(feed_data.back());
+      for (Request* req : batch) {
+        const TBlob& src = req->inputs->at(kv.first);
+        std::memcpy(dptr, src.data, src.shape.Size() * sizeof(float));
+        dptr += src.shape.Size();
+      }
+      blob.data = dmlc::BeginPtr(feed_data.back());
+      feed[kv.first] = blob;
+    }
+    // the outputs are written into the batch buffers once their shapes are known.
+    RunResult out;
+    if (!RunCached(feed, total, &out)) {
+      RunUncached(feed, total, &out);
+    }
+    // slice the outputs along dimension 0.
+    size_t row_begin = 0;
+    for (Request* req : batch) {
+      RunResult result;
+      result.buffers.resize(out.outputs.size());
+      for (size_t i = 0; i < out.outputs.size(); ++i) {
+        TBlob blob = out.outputs[i];
+        size_t row_size = blob.shape.Size() / total;
+        const float* src = static_cast<const float*>(blob.data) + row_begin * row_size;
+        result.buffers[i].assign(src, src + req->rows * row_size);
+        blob.shape[0] = req->rows;
+        blob.data = dmlc::BeginPtr(result.buffers[i]);
+        result.outputs.push_back(blob);
+      }
+      row_begin += req->rows;
+      req->result.set_value(std::move(result));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.num_requests += batch.size();
+    stats_.num_batches += 1;
+    stats_.num_rows += total;
+    stats_.last_batch_size = total;
+    stats_.max_batch_size = std::max(stats_.max_batch_size, total);
+  } catch (...) {
+    std::exception_ptr err = std::current_exception();
+    for (Request* req : batch) {
+      try {
+        req->result.set_exception(err);
+      } catch (const std::future_error&) {
+        // the result is already set.
+      }
+    }
+  }
+}
+
+Batcher* Batcher::Create(Session* sess, Symbol* g,
+                         size_t max_batch, int64_t timeout_us) {
+  return new BatcherImpl(sess, g, max_batch, timeout_us);
+}
+
+}  // namespace tinyflow
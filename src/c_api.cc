@@ -1,6 +1,10 @@
 // Copyright (c) 2016 by Contributors
 #include <tinyflow/base.h>
 #include <tinyflow/c_api.h>
+#include <dmlc/json.h>
+#include <chrono>
+#include <exception>
+#include <sstream>
 
 /*!
  * \brief handle exception throwed out
@@ -34,10 +38,74 @@ struct TinyAPIThreadLocalEntry {
   std::vector<nn_uint> shape_ndim;
   /*! \brief result holder for returning handles */
   std::vector<const nn_uint*> shape_data;
+  /*! \brief result holder for returning outputs */
+  tinyflow::RunResult result;
+  /*! \brief result holder for returning string */
+  std::string ret_str;
 };
 
 using namespace tinyflow;
 
+/*! \brief state of a submitted asynchronous run */
+struct TinyAPIRunEntry {
+  /*! \brief future of the outputs */
+  std::future<RunResult> future;
+  /*! \brief the outputs, valid after wait */
+  RunResult result;
+  /*! \brief whether the result is taken from future */
+  bool ready{false};
+  /*! \brief error of the run, rethrown by every wait */
+  std::exception_ptr error;
+  /*! \brief result holder for returning handles */
+  TinyAPIThreadLocalEntry ret;
+};
+
+// build the feed_dict from the C API arguments.
+inline std::unordered_map<std::string, TBlob> MakeFeedDict(
+    nn_uint num_feed,
+    const SymbolHandle* feed_placeholders,
+    const float** feed_dptr,
+    const nn_uint* feed_shape_csr_ptr,
+    const nn_uint* feed_shape_data) {
+  std::unordered_map<std::string, TBlob> feed;
+  for (nn_uint i = 0; i < num_feed; ++i) {
+    const std::string& key =
+        static_cast<nnvm::Symbol*>(feed_placeholders[i])->outputs[0].node->attrs.name;
+    TBlob tmp;
+    tmp.data = (void*)feed_dptr[i];  // NOLINT(*)
+    tmp.shape = TShape(feed_shape_data + feed_shape_csr_ptr[i],
+                       feed_shape_data + feed_shape_csr_ptr[i + 1]);
+    feed[key] = tmp;
+  }
+  return feed;
+}
+
+// return the outputs through the holders in ret.
+inline void SetOutputs(const std::vector<TBlob>& out,
+                       TinyAPIThreadLocalEntry* ret,
+                       nn_uint* num_out,
+                       const float*** out_dptr,
+                       const nn_uint** out_dtype,
+                       const nn_uint** out_shape_ndim,
+                       const nn_uint*** out_shape_data) {
+  *num_out = static_cast<nn_uint>(out.size());
+  ret->floatp.resize(out.size());
+  ret->dtype.resize(out.size());
+  ret->shape_ndim.resize(out.size());
+  ret->shape_data.resize(out.size());
+
+  for (size_t i = 0; i < out.size(); ++i) {
+    ret->floatp[i] = static_cast<const float*>(out[i].data);
+    ret->dtype[i] = out[i].dtype;
+    ret->shape_ndim[i] = out[i].shape.ndim();
+    ret->shape_data[i] = out[i].shape.data();
+  }
+  *out_dptr = dmlc::BeginPtr(ret->floatp);
+  *out_dtype = dmlc::BeginPtr(ret->dtype);
+  *out_shape_ndim = dmlc::BeginPtr(ret->shape_ndim);
+  *out_shape_data = dmlc::BeginPtr(ret->shape_data);
+}
+
 int NNSessionCreate(SessionHandle* handle, const char* option) {
   API_BEGIN();
   *handle = Session::Create(option);
@@ -50,6 +118,40 @@ int NNSessionClose(SessionHandle handle) {
   API_END();
 }
 
+int NNSessionSave(SessionHandle handle, const char* fname) {
+  API_BEGIN();
+  static_cast<Session*>(handle)->Save(fname);
+  API_END();
+}
+
+int NNSessionLoad(SessionHandle handle, const char* fname) {
+  API_BEGIN();
+  static_cast<Session*>(handle)->Load(fname);
+  API_END();
+}
+
+int NNSessionGetProfile(SessionHandle handle, int reset, const char** out_json) {
+  API_BEGIN();
+  auto* ret = dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get();
+  ret->ret_str = static_cast<Session*>(handle)->GetProfile(reset != 0);
+  *out_json = ret->ret_str.c_str();
+  API_END();
+}
+
+int NNSessionDumpTrace(SessionHandle handle, const char* fname) {
+  API_BEGIN();
+  static_cast<Session*>(handle)->DumpTrace(fname);
+  API_END();
+}
+
+int NNSessionGetMemoryReport(SessionHandle handle, const char** out_json) {
+  API_BEGIN();
+  auto* ret = dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get();
+  ret->ret_str = static_cast<Session*>(handle)->GetMemoryReport();
+  *out_json = ret->ret_str.c_str();
+  API_END();
+}
+
 int NNSessionRun(SessionHandle handle,
                  SymbolHandle graph,
                  nn_uint num_feed,
@@ -64,36 +166,161 @@ int NNSessionRun(SessionHandle handle,
                  const nn_uint** out_shape_ndim,
                  const nn_uint*** out_shape_data) {
   API_BEGIN();
-  std::unordered_map<std::string, TBlob> feed;
-  for (nn_uint i = 0; i < num_feed; ++i) {
-    const std::string& key =
-        static_cast<nnvm::Symbol*>(feed_placeholders[i])->outputs[0].node->attrs.name;
-    TBlob tmp;
-    tmp.data = (void*)feed_dptr[i];  // NOLINT(*)
-    tmp.shape = TShape(feed_shape_data + feed_shape_csr_ptr[i],
-                       feed_shape_data + feed_shape_csr_ptr[i + 1]);
-    feed[key] = tmp;
-  }
+  std::unordered_map<std::string, TBlob> feed = MakeFeedDict(
+      num_feed, feed_placeholders, feed_dptr,
+      feed_shape_csr_ptr, feed_shape_data);
 
   const std::vector<TBlob>& out = static_cast<Session*>(handle)->Run(
       static_cast<nnvm::Symbol*>(graph), feed);
-  *num_out = static_cast<nn_uint>(out.size());
-  auto* ret = dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get();
-  ret->floatp.resize(out.size());
-  ret->dtype.resize(out.size());
-  ret->shape_ndim.resize(out.size());
-  ret->shape_data.resize(out.size());
+  SetOutputs(out, dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get(),
+             num_out, out_dptr, out_dtype, out_shape_ndim, out_shape_data);
+  API_END();
+  return 0;
+}
 
-  for (size_t i = 0; i < out.size(); ++i) {
-    ret->floatp[i] = static_cast<const float*>(out[i].data);
-    ret->dtype[i] = out[i].dtype;
-    ret->shape_ndim[i] = out[i].shape.ndim();
-    ret->shape_data[i] = out[i].shape.data();
+int NNSessionRunInto(SessionHandle handle,
+                     SymbolHandle graph,
+                     nn_uint num_feed,
+                     const SymbolHandle* feed_placeholders,
+                     const float** feed_dptr,
+                     const nn_uint* feed_dtype,
+                     const nn_uint* feed_shape_csr_ptr,
+                     const nn_uint* feed_shape_data,
+                     nn_uint num_out,
+                     float** out_dptr,
+                     const nn_uint* out_size) {
+  API_BEGIN();
+  std::unordered_map<std::string, TBlob> feed = MakeFeedDict(
+      num_feed, feed_placeholders, feed_dptr,
+      feed_shape_csr_ptr, feed_shape_data);
+  std::vector<TBlob> outputs(num_out);
+  for (nn_uint i = 0; i < num_out; ++i) {
+    outputs[i].data = out_dptr[i];
+    outputs[i].shape = TShape{out_size[i]};
   }
-  *out_dptr = dmlc::BeginPtr(ret->floatp);
-  *out_dtype = dmlc::BeginPtr(ret->dtype);
-  *out_shape_ndim = dmlc::BeginPtr(ret->shape_ndim);
-  *out_shape_data = dmlc::BeginPtr(ret->shape_data);
+  static_cast<Session*>(handle)->Run(
+      static_cast<nnvm::Symbol*>(graph), feed, outputs);
+  API_END();
+}
+
+int NNSessionRunAsync(SessionHandle handle,
+                      SymbolHandle graph,
+                      nn_uint num_feed,
+                      const SymbolHandle* feed_placeholders,
+                      const float** feed_dptr,
+                      const nn_uint* feed_dtype,
+                      const nn_uint* feed_shape_csr_ptr,
+                      const nn_uint* feed_shape_data,
+                      RunHandle* out) {
+  API_BEGIN();
+  std::unordered_map<std::string, TBlob> feed = MakeFeedDict(
+      num_feed, feed_placeholders, feed_dptr,
+      feed_shape_csr_ptr, feed_shape_data);
+  TinyAPIRunEntry* entry = new TinyAPIRunEntry();
+  try {
+    entry->future = static_cast<Session*>(handle)->RunAsync(
+        static_cast<nnvm::Symbol*>(graph), feed);
+  } catch (...) {
+    delete entry;
+    throw;
+  }
+  *out = entry;
+  API_END();
+}
+
+int NNRunWait(RunHandle handle,
+              nn_uint* num_out,
+              const float*** out_dptr,
+              const nn_uint** out_dtype,
+              const nn_uint** out_shape_ndim,
+              const nn_uint*** out_shape_data) {
+  API_BEGIN();
+  TinyAPIRunEntry* entry = static_cast<TinyAPIRunEntry*>(handle);
+  if (!entry->ready) {
+    // the future can only be taken once, keep its error for later waits.
+    try {
+      entry->result = entry->future.get();
+    } catch (...) {
+      entry->error = std::current_exception();
+    }
+    entry->ready = true;
+  }
+  if (entry->error != nullptr) std::rethrow_exception(entry->error);
+  SetOutputs(entry->result.outputs, &(entry->ret),
+             num_out, out_dptr, out_dtype, out_shape_ndim, out_shape_data);
+  API_END();
+}
+
+int NNRunIsReady(RunHandle handle, int* out) {
+  API_BEGIN();
+  TinyAPIRunEntry* entry = static_cast<TinyAPIRunEntry*>(handle);
+  *out = entry->ready ||
+      entry->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  API_END();
+}
+
+int NNRunFree(RunHandle handle) {
+  API_BEGIN();
+  delete static_cast<TinyAPIRunEntry*>(handle);
+  API_END();
+}
+
+int NNBatcherCreate(SessionHandle session,
+                    SymbolHandle graph,
+                    nn_uint max_batch,
+                    nn_uint timeout_us,
+                    BatcherHandle* out) {
+  API_BEGIN();
+  *out = Batcher::Create(static_cast<Session*>(session),
+                         static_cast<nnvm::Symbol*>(graph),
+                         max_batch, timeout_us);
+  API_END();
+}
+
+int NNBatcherFree(BatcherHandle handle) {
+  API_BEGIN();
+  delete static_cast<Batcher*>(handle);
+  API_END();
+}
+
+int NNBatcherRun(BatcherHandle handle,
+                 nn_uint num_feed,
+                 const SymbolHandle* feed_placeholders,
+                 const float** feed_dptr,
+                 const nn_uint* feed_dtype,
+                 const nn_uint* feed_shape_csr_ptr,
+                 const nn_uint* feed_shape_data,
+                 nn_uint* num_out,
+                 const float*** out_dptr,
+                 const nn_uint** out_dtype,
+                 const nn_uint** out_shape_ndim,
+                 const nn_uint*** out_shape_data) {
+  API_BEGIN();
+  std::unordered_map<std::string, TBlob> feed = MakeFeedDict(
+      num_feed, feed_placeholders, feed_dptr,
+      feed_shape_csr_ptr, feed_shape_data);
+  auto* ret = dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get();
+  ret->result = static_cast<Batcher*>(handle)->Run(feed);
+  SetOutputs(ret->result.outputs, ret,
+             num_out, out_dptr, out_dtype, out_shape_ndim, out_shape_data);
+  API_END();
+}
+
+int NNBatcherGetStats(BatcherHandle handle, const char** out_stats) {
+  API_BEGIN();
+  Batcher::Stats stats = static_cast<Batcher*>(handle)->GetStats();
+  std::ostringstream os;
+  dmlc::JSONWriter writer(&os);
+  writer.BeginObject();
+  writer.WriteObjectKeyValue("queue_depth", stats.queue_depth);
+  writer.WriteObjectKeyValue("num_requests", stats.num_requests);
+  writer.WriteObjectKeyValue("num_batches", stats.num_batches);
+  writer.WriteObjectKeyValue("num_rows", stats.num_rows);
+  writer.WriteObjectKeyValue("last_batch_size", stats.last_batch_size);
+  writer.WriteObjectKeyValue("max_batch_size", stats.max_batch_size);
+  writer.EndObject();
+  auto* ret = dmlc::ThreadLocalStore<TinyAPIThreadLocalEntry>::Get();
+  ret->ret_str = os.str();
+  *out_stats = ret->ret_str.c_str();
   API_END();
-  return 0;
 }
@@ -0,0 +1,147 @@
+// Copyright (c) 2016 by Contributors
+// checkpoint of variables, see checkpoint.h for the layout.
+#include <dmlc/logging.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include "./checkpoint.h"
+
+namespace tinyflow {
+
+// reads "TFLOWCKP" in files written by little endian hosts.
+const uint64_t kCheckpointMagic = 0x504b43574f4c4654ULL;
+// the magic as read from a file written by a host of the other byte order.
+const uint64_t kCheckpointMagicSwapped = 0x54464c4f57434b50ULL;
+const uint32_t kCheckpointVersion = 1;
+
+inline size_t AlignCheckpoint(size_t offset) {
+  return (offset + kCheckpointAlign - 1) / kCheckpointAlign * kCheckpointAlign;
+}
+
+inline size_t DTypeSize(int dtype) {
+  CHECK_EQ(dtype, kFloat32) << "only float is supported so far";
+  return sizeof(float);
+}
+
+template<typename T>
+inline void WritePOD(std::ofstream* os, const T& value) {
+  os->write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void SaveCheckpoint(const std::string& fname,
+                    const std::vector<std::pair<std::string, TBlob> >& vars) {
+  // size of header and index, to find where data begins.
+  size_t index_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+  for (const auto& kv : vars) {
+    CHECK_EQ(kv.second.dev_mask, kCPU) << "checkpoint data must be on cpu";
+    index_size += 3 * sizeof(uint32_t) + kv.first.length() +
+        kv.second.shape.ndim() * sizeof(uint64_t) + 2 * sizeof(uint64_t);
+  }
+  std::vector<uint64_t> offset(vars.size());
+  size_t end = index_size;
+  for (size_t i = 0; i < vars.size(); ++i) {
+    offset[i] = AlignCheckpoint(end);
+    end = offset[i] + vars[i].second.shape.Size() * DTypeSize(vars[i].second.dtype);
+  }
+
+  std::ofstream os(fname.c_str(), std::ios::binary | std::ios::trunc);
+  CHECK(os.good()) << "cannot open " << fname << " to write";
+  WritePOD(&os, kCheckpointMagic);
+  WritePOD(&os, kCheckpointVersion);
+  WritePOD(&os, static_cast<uint32_t>(vars.size()));
+  for (size_t i = 0; i < vars.size(); ++i) {
+    const std::string& name = vars[i].first;
+    const TBlob& blob = vars[i].second;
+    WritePOD(&os, static_cast<uint32_t>(name.length()));
+    os.write(name.c_str(), name.length());
+    WritePOD(&os, static_cast<int32_t>(blob.dtype));
+    WritePOD(&os, static_cast<uint32_t>(blob.shape.ndim()));
+    for (size_t k = 0; k < blob.shape.ndim(); ++k) {
+      WritePOD(&os, static_cast<uint64_t>(blob.shape[k]));
+    }
+    WritePOD(&os, offset[i]);
+    WritePOD(&os, static_cast<uint64_t>(blob.shape.Size() * DTypeSize(blob.dtype)));
+  }
+  std::vector<char> padding(kCheckpointAlign, 0);
+  size_t pos = index_size;
+  for (size_t i = 0; i < vars.size(); ++i) {
+    const TBlob& blob = vars[i].second;
+    os.write(dmlc::BeginPtr(padding), offset[i] - pos);
+    size_t nbytes = blob.shape.Size() * DTypeSize(blob.dtype);
+    os.write(static_cast<const char*>(blob.data), nbytes);
+    pos = offset[i] + nbytes;
+  }
+  CHECK(os.good()) << "failed to write " << fname;
+}
+
+MappedCheckpoint::MappedCheckpoint(const std::string& fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "cannot open " << fname;
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "cannot stat " << fname;
+  size_ = static_cast<size_t>(st.st_size);
+  CHECK_GE(size_, sizeof(uint64_t) + 2 * sizeof(uint32_t))
+      << fname << " is not a checkpoint";
+  addr_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  CHECK(addr_ != MAP_FAILED) << "cannot map " << fname;
+  try {
+    ParseIndex(fname);
+  } catch (...) {
+    munmap(addr_, size_);
+    throw;
+  }
+}
+
+void MappedCheckpoint::ParseIndex(const std::string& fname) {
+  const char* begin = static_cast<const char*>(addr_);
+  size_t pos = 0;
+  auto read = [begin, &pos, this, &fname](void* dst, size_t nbytes) {
+    CHECK_LE(pos + nbytes, size_) << fname << " is truncated";
+    std::memcpy(dst, begin + pos, nbytes);
+    pos += nbytes;
+  };
+  uint64_t magic;
+  uint32_t version, num_vars;
+  read(&magic, sizeof(magic));
+  CHECK_NE(magic, kCheckpointMagicSwapped)
+      << fname << " is written by a host of the other byte order";
+  CHECK_EQ(magic, kCheckpointMagic) << fname << " is not a checkpoint";
+  read(&version, sizeof(version));
+  CHECK_EQ(version, kCheckpointVersion)
+      << "unsupported checkpoint version " << version;
+  read(&num_vars, sizeof(num_vars));
+  for (uint32_t i = 0; i < num_vars; ++i) {
+    uint32_t name_len, ndim;
+    int32_t dtype;
+    read(&name_len, sizeof(name_len));
+    std::string name(name_len, '\0');
+    read(&name[0], name_len);
+    read(&dtype, sizeof(dtype));
+    read(&ndim, sizeof(ndim));
+    std::vector<uint64_t> dims(ndim);
+    read(dmlc::BeginPtr(dims), ndim * sizeof(uint64_t));
+    uint64_t offset, nbytes;
+    read(&offset, sizeof(offset));
+    read(&nbytes, sizeof(nbytes));
+    TBlob blob;
+    blob.shape = TShape(dims.begin(), dims.end());
+    blob.dtype = dtype;
+    blob.dev_mask = kCPU;
+    CHECK_EQ(nbytes, blob.shape.Size() * DTypeSize(dtype))
+        << "size of variable " << name << " mismatch";
+    CHECK_LE(offset + nbytes, size_) << fname << " is truncated";
+    blob.data = static_cast<char*>(addr_) + offset;
+    vars_.emplace_back(std::move(name), blob);
+  }
+}
+
+MappedCheckpoint::~MappedCheckpoint() {
+  if (addr_ != nullptr) munmap(addr_, size_);
+}
+
+}  // namespace tinyflow
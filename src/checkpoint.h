@@ -0,0 +1,65 @@
+/*!
+ *  Copyright (c) 2016 by Contributors
+ * \file checkpoint.h
+ * \brief binary checkpoint of variables, restored with mmap.
+ *
+ *  Integers and data are in the byte order of the host that wrote the file,
+ *  so the data can be mapped without conversion. The magic number marks
+ *  the byte order, loading a file of the other byte order is an error.
+ *
+ *  Layout of the file:
+ *  - header: magic(uint64), version(uint32), number of variables(uint32)
+ *  - index, for each variable:
+ *    name length(uint32), name, dtype(int32), ndim(uint32),
+ *    shape(uint64 x ndim), offset of data(uint64), bytes of data(uint64)
+ *  - data of each variable, aligned to kCheckpointAlign bytes.
+ */
+#ifndef TINYFLOW_CHECKPOINT_H_
+#define TINYFLOW_CHECKPOINT_H_
+
+#include <tinyflow/base.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tinyflow {
+
+/*! \brief alignment of variable data in checkpoint, a page. */
+const size_t kCheckpointAlign = 4096;
+
+/*!
+ * \brief write variables into a checkpoint file.
+ * \param fname The file name.
+ * \param vars The name and content of variables, the content must be on cpu.
+ */
+void SaveCheckpoint(const std::string& fname,
+                    const std::vector<std::pair<std::string, TBlob> >& vars);
+
+/*!
+ * \brief a checkpoint file mapped into memory.
+ *  The pages are mapped private, so they are shared between processes
+ *  until written, writes are copied and never reach the file.
+ */
+class MappedCheckpoint {
+ public:
+  explicit MappedCheckpoint(const std::string& fname);
+  ~MappedCheckpoint();
+  /*! \return variables in the file, the data points to the mapped pages. */
+  inline const std::vector<std::pair<std::string, TBlob> >& vars() const {
+    return vars_;
+  }
+
+ private:
+  // read the index, point variables to the mapped data.
+  void ParseIndex(const std::string& fname);
+  // start of the mapping.
+  void* addr_{nullptr};
+  // size of the mapping.
+  size_t size_{0};
+  // variables in the file.
+  std::vector<std::pair<std::string, TBlob> > vars_;
+};
+
+}  // namespace tinyflow
+
+#endif  // TINYFLOW_CHECKPOINT_H_
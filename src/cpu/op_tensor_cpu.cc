@@ -0,0 +1,386 @@
+// Copyright (c) 2016 by Contributors
+// native cpu implementation of elementwise tensor operators
+#include <tinyflow/base.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "../thread_pool.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TINYFLOW_USE_SSE 1
+#else
+#define TINYFLOW_USE_SSE 0
+#endif
+
+namespace tinyflow {
+
+using nnvm::NodeAttrs;
+using FOpExec = std::function<void()>;
+
+// elementwise operator definitions,
+// Map(float) is the scalar version, Map(__m128) the packet version.
+namespace op {
+struct plus {
+  static float Map(float a, float b) { return a + b; }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+#endif
+};
+struct minus {
+  static float Map(float a, float b) { return a - b; }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+#endif
+};
+struct mul {
+  static float Map(float a, float b) { return a * b; }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+#endif
+};
+struct div {
+  static float Map(float a, float b) { return a / b; }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a, __m128 b) { return _mm_div_ps(a, b); }
+#endif
+};
+struct equal {
+  static float Map(float a, float b) { return a == b ? 1.0f : 0.0f; }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a, __m128 b) {
+    return _mm_and_ps(_mm_cmpeq_ps(a, b), _mm_set1_ps(1.0f));
+  }
+#endif
+};
+struct sqrt {
+  static float Map(float a) { return std::sqrt(a); }
+#if TINYFLOW_USE_SSE
+  static __m128 Map(__m128 a) { return _mm_sqrt_ps(a); }
+#endif
+};
+// the following ones do not have a packet version
+struct exp {
+  static float Map(float a) { return std::exp(a); }
+};
+struct log {
+  static float Map(float a) { return std::log(a); }
+};
+struct power {
+  static float Map(float a, float b) { return std::pow(a, b); }
+};
+}  // namespace op
+
+// y[i] = OP(a[i], b[i]), y can be same as a or b.
+template<typename OP>
+inline void BinaryMap(const float* a, const float* b, float* y, size_t n) {
+  size_t i = 0;
+#if TINYFLOW_USE_SSE
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, OP::Map(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+  for (; i < n; ++i) y[i] = OP::Map(a[i], b[i]);
+}
+
+// y[i] = OP(a[i], b)
+template<typename OP>
+inline void BinaryMapRScalar(const float* a, float b, float* y, size_t n) {
+  size_t i = 0;
+#if TINYFLOW_USE_SSE
+  const __m128 pb = _mm_set1_ps(b);
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, OP::Map(_mm_loadu_ps(a + i), pb));
+  }
+#endif
+  for (; i < n; ++i) y[i] = OP::Map(a[i], b);
+}
+
+// y[i] = OP(a, b[i])
+template<typename OP>
+inline void BinaryMapLScalar(float a, const float* b, float* y, size_t n) {
+  size_t i = 0;
+#if TINYFLOW_USE_SSE
+  const __m128 pa = _mm_set1_ps(a);
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, OP::Map(pa, _mm_loadu_ps(b + i)));
+  }
+#endif
+  for (; i < n; ++i) y[i] = OP::Map(a, b[i]);
+}
+
+// y[i] = OP(a[i]), for ops with packet version
+template<typename OP>
+inline void UnaryMapPacket(const float* a, float* y, size_t n) {
+  size_t i = 0;
+#if TINYFLOW_USE_SSE
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, OP::Map(_mm_loadu_ps(a + i)));
+  }
+#endif
+  for (; i < n; ++i) y[i] = OP::Map(a[i]);
+}
+
+// y[i] = OP(a[i])
+template<typename OP>
+inline void UnaryMap(const float* a, float* y, size_t n) {
+  for (size_t i = 0; i < n; ++i) y[i] = OP::Map(a[i]);
+}
+
+// scalar version of binary op, no packet needed.
+template<typename OP>
+inline void BinaryMapScalarOnly(const float* a, const float* b, float* y, size_t n) {
+  for (size_t i = 0; i < n; ++i) y[i] = OP::Map(a[i], b[i]);
+}
+
+inline const float* CPtr(const TBlob* b) {
+  return static_cast<const float*>(b->data);
+}
+
+inline float* Ptr(const TBlob* b) {
+  return static_cast<float*>(b->data);
+}
+
+inline void CheckFloatCPU(const std::vector<const TBlob*>& blobs) {
+  for (const TBlob* b : blobs) {
+    CHECK_EQ(b->dev_mask, kCPU) << "FCompute only runs on cpu";
+    CHECK_EQ(b->dtype, kFloat32) << "only float is supported so far";
+  }
+}
+
+// minimum number of elements per chunk when a map is split across threads.
+const size_t kMapGrain = 1 << 15;
+
+// run fchunk(begin, end) over [0, n) with the shared thread pool.
+template<typename FChunk>
+inline void ParallelMap(size_t n, FChunk fchunk) {
+  ParallelFor(0, n, kMapGrain, fchunk);
+}
+
+inline float GetScalar(const NodeAttrs& attrs) {
+  auto it = attrs.dict.find("scalar");
+  CHECK(it != attrs.dict.end())
+      << "scalar argument is required by " << attrs.op->name;
+  return std::stof(it->second);
+}
+
+// binary op between two tensors,
+// a tensor of shape (1,) is broadcasted as scalar.
+template<typename OP>
+inline FOpExec BinaryCompute(const NodeAttrs& attrs,
+                             const std::vector<const TBlob*>& inputs,
+                             const std::vector<const TBlob*>& outputs) {
+  CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+  const TBlob* lhs = inputs[0];
+  const TBlob* rhs = inputs[1];
+  const TBlob* out = outputs[0];
+  return [lhs, rhs, out]() {
+    size_t n = out->shape.Size();
+    const float* a = CPtr(lhs);
+    const float* b = CPtr(rhs);
+    float* y = Ptr(out);
+    if (lhs->shape.Size() == 1 && n != 1) {
+      ParallelMap(n, [a, b, y](size_t begin, size_t end) {
+          BinaryMapLScalar<OP>(a[0], b + begin, y + begin, end - begin);
+        });
+    } else if (rhs->shape.Size() == 1 && n != 1) {
+      ParallelMap(n, [a, b, y](size_t begin, size_t end) {
+          BinaryMapRScalar<OP>(a + begin, b[0], y + begin, end - begin);
+        });
+    } else {
+      ParallelMap(n, [a, b, y](size_t begin, size_t end) {
+          BinaryMap<OP>(a + begin, b + begin, y + begin, end - begin);
+        });
+    }
+  };
+}
+
+// binary op between tensor and scalar argument.
+template<typename OP, bool reverse>
+inline FOpExec ScalarCompute(const NodeAttrs& attrs,
+                             const std::vector<const TBlob*>& inputs,
+                             const std::vector<const TBlob*>& outputs) {
+  CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+  const TBlob* in = inputs[0];
+  const TBlob* out = outputs[0];
+  float scalar = GetScalar(attrs);
+  return [in, out, scalar]() {
+    const float* a = CPtr(in);
+    float* y = Ptr(out);
+    ParallelMap(out->shape.Size(), [a, y, scalar](size_t begin, size_t end) {
+        if (reverse) {
+          BinaryMapLScalar<OP>(scalar, a + begin, y + begin, end - begin);
+        } else {
+          BinaryMapRScalar<OP>(a + begin, scalar, y + begin, end - begin);
+        }
+      });
+  };
+}
+
+template<typename OP>
+inline FOpExec UnaryPacketCompute(const NodeAttrs& attrs,
+                                  const std::vector<const TBlob*>& inputs,
+                                  const std::vector<const TBlob*>& outputs) {
+  CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+  const TBlob* in = inputs[0];
+  const TBlob* out = outputs[0];
+  return [in, out]() {
+    const float* a = CPtr(in);
+    float* y = Ptr(out);
+    ParallelMap(out->shape.Size(), [a, y](size_t begin, size_t end) {
+        UnaryMapPacket<OP>(a + begin, y + begin, end - begin);
+      });
+  };
+}
+
+template<typename OP>
+inline FOpExec UnaryCompute(const NodeAttrs& attrs,
+                            const std::vector<const TBlob*>& inputs,
+                            const std::vector<const TBlob*>& outputs) {
+  CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+  const TBlob* in = inputs[0];
+  const TBlob* out = outputs[0];
+  return [in, out]() {
+    const float* a = CPtr(in);
+    float* y = Ptr(out);
+    ParallelMap(out->shape.Size(), [a, y](size_t begin, size_t end) {
+        UnaryMap<OP>(a + begin, y + begin, end - begin);
+      });
+  };
+}
+
+template<int value>
+inline FOpExec FillCompute(const NodeAttrs& attrs,
+                           const std::vector<const TBlob*>& inputs,
+                           const std::vector<const TBlob*>& outputs) {
+  CheckFloatCPU(outputs);
+  const TBlob* out = outputs[0];
+  return [out]() {
+    std::fill(Ptr(out), Ptr(out) + out->shape.Size(), static_cast<float>(value));
+  };
+}
+
+
+NNVM_REGISTER_OP(zeros)
+.set_attr<FCompute>("FCompute", FillCompute<0>);
+
+NNVM_REGISTER_OP(zeros_like)
+.set_attr<FCompute>("FCompute", FillCompute<0>);
+
+NNVM_REGISTER_OP(ones)
+.set_attr<FCompute>("FCompute", FillCompute<1>);
+
+NNVM_REGISTER_OP(ones_like)
+.set_attr<FCompute>("FCompute", FillCompute<1>);
+
+NNVM_REGISTER_OP(equal)
+.set_attr<FCompute>("FCompute", BinaryCompute<op::equal>);
+
+
+NNVM_REGISTER_OP(__ewise_sum__)
+.set_attr<FCompute>(
+  "FCompute", [](const NodeAttrs& attrs,
+                 const std::vector<const TBlob*>& inputs,
+                 const std::vector<const TBlob*>& outputs) {
+    CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+    std::vector<const TBlob*> in = inputs;
+    const TBlob* out = outputs[0];
+    return FOpExec([in, out]() {
+      float* y = Ptr(out);
+      ParallelMap(out->shape.Size(), [&in, y](size_t begin, size_t end) {
+          // sum a block in cache before writing it, so the output is
+          // written once and can be any of the inputs.
+          const size_t kBlock = 1024;
+          float acc[kBlock];
+          for (size_t i = begin; i < end; i += kBlock) {
+            size_t n = std::min(kBlock, end - i);
+            std::copy(CPtr(in[0]) + i, CPtr(in[0]) + i + n, acc);
+            for (size_t k = 1; k < in.size(); ++k) {
+              BinaryMap<op::plus>(acc, CPtr(in[k]) + i, acc, n);
+            }
+            std::copy(acc, acc + n, y + i);
+          }
+        });
+    });
+  });
+
+
+NNVM_REGISTER_OP(__add_symbol__)
+.set_attr<FCompute>("FCompute", BinaryCompute<op::plus>);
+
+NNVM_REGISTER_OP(__add_scalar__)
+.set_attr<FCompute>("FCompute", ScalarCompute<op::plus, false>);
+
+NNVM_REGISTER_OP(__sub_symbol__)
+.set_attr<FCompute>("FCompute", BinaryCompute<op::minus>);
+
+NNVM_REGISTER_OP(__sub_scalar__)
+.set_attr<FCompute>("FCompute", ScalarCompute<op::minus, false>);
+
+NNVM_REGISTER_OP(__rsub_scalar__)
+.set_attr<FCompute>("FCompute", ScalarCompute<op::minus, true>);
+
+NNVM_REGISTER_OP(__mul_symbol__)
+.set_attr<FCompute>("FCompute", BinaryCompute<op::mul>);
+
+NNVM_REGISTER_OP(__mul_scalar__)
+.set_attr<FCompute>("FCompute", ScalarCompute<op::mul, false>);
+
+NNVM_REGISTER_OP(__div_symbol__)
+.set_attr<FCompute>("FCompute", BinaryCompute<op::div>);
+
+NNVM_REGISTER_OP(__div_scalar__)
+.set_attr<FCompute>("FCompute", ScalarCompute<op::div, false>);
+
+NNVM_REGISTER_OP(exp)
+.set_attr<FCompute>("FCompute", UnaryCompute<op::exp>);
+
+NNVM_REGISTER_OP(log)
+.set_attr<FCompute>("FCompute", UnaryCompute<op::log>);
+
+NNVM_REGISTER_OP(sqrt)
+.set_attr<FCompute>("FCompute", UnaryPacketCompute<op::sqrt>);
+
+
+NNVM_REGISTER_OP(__pow_symbol__)
+.set_attr<FCompute>(
+  "FCompute", [](const NodeAttrs& attrs,
+                 const std::vector<const TBlob*>& inputs,
+                 const std::vector<const TBlob*>& outputs) {
+    CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+    const TBlob* lhs = inputs[0];
+    const TBlob* rhs = inputs[1];
+    const TBlob* out = outputs[0];
+    return FOpExec([lhs, rhs, out]() {
+      const float* a = CPtr(lhs);
+      const float* b = CPtr(rhs);
+      float* y = Ptr(out);
+      ParallelMap(out->shape.Size(), [a, b, y](size_t begin, size_t end) {
+          BinaryMapScalarOnly<op::power>(
+              a + begin, b + begin, y + begin, end - begin);
+        });
+    });
+  });
+
+
+NNVM_REGISTER_OP(__rpow_scalar__)
+.set_attr<FCompute>(
+  "FCompute", [](const NodeAttrs& attrs,
+                 const std::vector<const TBlob*>& inputs,
+                 const std::vector<const TBlob*>& outputs) {
+    CheckFloatCPU(inputs); CheckFloatCPU(outputs);
+    const TBlob* in = inputs[0];
+    const TBlob* out = outputs[0];
+    float scalar = GetScalar(attrs);
+    return FOpExec([in, out, scalar]() {
+      const float* src = CPtr(in);
+      float* dst = Ptr(out);
+      ParallelMap(out->shape.Size(), [src, dst, scalar](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            dst[i] = std::pow(scalar, src[i]);
+          }
+        });
+    });
+  });
+
+}  // namespace tinyflow
@@ -13,7 +13,8 @@ const FLuaCompute kLuaNOP = "function(x, y, kwarg) return function() end end";
 
 NNVM_REGISTER_OP(placeholder)
 .describe("placeholder op")
-.set_num_inputs(0);
+.set_num_inputs(0)
+.set_attr<TNoCompute>("TNoCompute", true);
 
 template<typename Attr>
 inline bool EmptyAttr(const NodeAttrs& attrs,
@@ -26,6 +27,7 @@ NNVM_REGISTER_OP(_nop)
 .describe("no operation")
 .set_num_inputs(0)
 .set_num_outputs(1)
+.set_attr<TNoCompute>("TNoCompute", true)
 .set_attr<FInferShape>("FInferShape", EmptyAttr<TShape>)
 .set_attr<FInferType>("FInferType", EmptyAttr<int>);
 
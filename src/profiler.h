@@ -0,0 +1,186 @@
+/*!
+ *  Copyright (c) 2016 by Contributors
+ * \file profiler.h
+ * \brief timing of operators and executor setup phases,
+ *  and timeline of the runs in chrome trace event format.
+ */
+#ifndef TINYFLOW_PROFILER_H_
+#define TINYFLOW_PROFILER_H_
+
+#include <dmlc/json.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace tinyflow {
+
+/*!
+ * \brief collects the time spent in operators and setup phases,
+ *  aggregated across runs. Can be used from multiple threads.
+ */
+class Profiler {
+ public:
+  /*! \brief aggregated time of one key */
+  struct Stat {
+    size_t count{0};
+    double total_us{0};
+    double max_us{0};
+    inline void Add(double us) {
+      ++count;
+      total_us += us;
+      max_us = std::max(max_us, us);
+    }
+    inline void Save(dmlc::JSONWriter* writer) const {
+      writer->BeginObject();
+      writer->WriteObjectKeyValue("count", count);
+      writer->WriteObjectKeyValue("total_us", total_us);
+      writer->WriteObjectKeyValue("max_us", max_us);
+      writer->EndObject();
+    }
+  };
+  /*! \brief a timed event on the timeline */
+  struct TraceEvent {
+    // node name, or the copied tensor.
+    std::string name;
+    // op name, or copy.
+    std::string cat;
+    double begin_us{0};
+    double end_us{0};
+    // small id of the thread the event runs on.
+    int tid{0};
+    // shapes of the output tensors.
+    std::string shape;
+    // bytes of the output tensors.
+    size_t bytes{0};
+    inline void Save(dmlc::JSONWriter* writer) const {
+      writer->BeginObject();
+      writer->WriteObjectKeyValue("name", name);
+      writer->WriteObjectKeyValue("cat", cat);
+      writer->WriteObjectKeyValue("ph", std::string("X"));
+      writer->WriteObjectKeyValue("ts", begin_us);
+      writer->WriteObjectKeyValue("dur", end_us - begin_us);
+      writer->WriteObjectKeyValue("pid", 0);
+      writer->WriteObjectKeyValue("tid", tid);
+      writer->WriteObjectKeyValue("args", Args{shape, bytes});
+      writer->EndObject();
+    }
+    struct Args {
+      const std::string& shape;
+      size_t bytes;
+      inline void Save(dmlc::JSONWriter* writer) const {
+        writer->BeginObject();
+        writer->WriteObjectKeyValue("shape", shape);
+        writer->WriteObjectKeyValue("bytes", bytes);
+        writer->EndObject();
+      }
+    };
+  };
+  explicit Profiler(bool trace = false) : trace_(trace) {}
+  /*! \return whether trace events are recorded. */
+  inline bool trace() const {
+    return trace_;
+  }
+  /*! \return current time in microseconds. */
+  static double NowMicros() {
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  /*! \brief record one run of a node. */
+  void AddOp(const std::string& op_name, const std::string& node_name, double us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ops_[op_name].Add(us);
+    nodes_[node_name].Add(us);
+  }
+  /*! \brief record one run of a setup phase. */
+  void AddPhase(const std::string& phase, double us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    phases_[phase].Add(us);
+  }
+  /*! \brief record a trace event run by the current thread. */
+  void AddTrace(const std::string& name, const std::string& cat,
+                double begin_us, double end_us,
+                const std::string& shape, size_t bytes) {
+    TraceEvent e;
+    e.name = name;
+    e.cat = cat;
+    e.begin_us = begin_us;
+    e.end_us = end_us;
+    e.shape = shape;
+    e.bytes = bytes;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = thread_ids_.find(std::this_thread::get_id());
+    if (it == thread_ids_.end()) {
+      int tid = static_cast<int>(thread_ids_.size());
+      it = thread_ids_.emplace(std::this_thread::get_id(), tid).first;
+    }
+    e.tid = it->second;
+    events_.emplace_back(std::move(e));
+  }
+  /*! \brief write the trace events in chrome trace format and clear them. */
+  void WriteTrace(std::ostream* os) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dmlc::JSONWriter writer(os);
+    writer.BeginObject();
+    writer.WriteObjectKeyValue("traceEvents", events_);
+    writer.WriteObjectKeyValue("displayTimeUnit", std::string("ms"));
+    writer.EndObject();
+    events_.clear();
+  }
+  /*! \brief clear the records. */
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ops_.clear();
+    nodes_.clear();
+    phases_.clear();
+  }
+  /*! \return the records as a json object with fields ops, nodes and phases. */
+  std::string ToJSON() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream os;
+    dmlc::JSONWriter writer(&os);
+    writer.BeginObject();
+    writer.WriteObjectKeyValue("ops", ops_);
+    writer.WriteObjectKeyValue("nodes", nodes_);
+    writer.WriteObjectKeyValue("phases", phases_);
+    writer.EndObject();
+    return os.str();
+  }
+
+ private:
+  std::map<std::string, Stat> ops_, nodes_, phases_;
+  // whether to record trace events.
+  bool trace_;
+  std::vector<TraceEvent> events_;
+  std::unordered_map<std::thread::id, int> thread_ids_;
+  std::mutex mutex_;
+};
+
+/*! \brief record the time of a scope as a phase, no-op when profiler is nullptr. */
+class ProfilePhase {
+ public:
+  ProfilePhase(Profiler* profiler, const char* phase)
+      : profiler_(profiler), phase_(phase) {
+    if (profiler_ != nullptr) begin_ = Profiler::NowMicros();
+  }
+  ~ProfilePhase() {
+    if (profiler_ != nullptr) {
+      profiler_->AddPhase(phase_, Profiler::NowMicros() - begin_);
+    }
+  }
+
+ private:
+  Profiler* profiler_;
+  const char* phase_;
+  double begin_{0};
+};
+
+}  // namespace tinyflow
+
+#endif  // TINYFLOW_PROFILER_H_
@@ -1,13 +1,31 @@
 // Copyright (c) 2016 by Contributors
 #include <tinyflow/base.h>
 #include <nnvm/pass_functions.h>
+#include <dmlc/json.h>
 #if TINYFLOW_USE_FUSION == 1
 #include <nnvm-fusion/base.h>
 #include <nnvm-fusion/rtc.h>
 #endif
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 #include <functional>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include "./checkpoint.h"
 #include "./op_util.h"
+#include "./profiler.h"
+#include "./thread_pool.h"
 #include "./torch/torch_util.h"
 
 namespace tinyflow {
@@ -25,83 +43,542 @@ using nnvm::fusion::RTCMap;
 
 class TorchExecutor;
 
-/*! \brief shared variable */
-struct VarState {
-  /*! \brief The internal internal tensor */
+struct VarState;
+
+// tensor of a variable in the lua state of one thread.
+struct VarView {
   LuaRef tensor;
+  // version of the memory the tensor points to.
+  size_t version{0};
+};
+// views of the variables used by one thread.
+using VarViewMap = std::unordered_map<const VarState*, VarView>;
+
+/*!
+ * \brief shared variable.
+ *  Lua objects can only be used by the thread that created them,
+ *  so each thread accesses the variable through its own tensor in
+ *  a VarViewMap of that thread, all of them point to the same memory.
+ *  Memory on cpu is owned by the variable, so it does not depend
+ *  on the lifetime of any thread.
+ *  The caller must hold the variable lock of the session.
+ */
+struct VarState {
   /*! \brief The corresponding tblob */
   TBlob blob;
+  /*! \brief increased every time the memory is reallocated */
+  size_t version{0};
 
   /*! \return Whether the tensor is initialized already */
   inline bool initialized() const {
-    return !tensor.is_nil();
+    return version != 0;
   }
   // reset the space.
-  inline void ResetSpace(TShape shape, int dev_mask = kCPU, int dtype = 0) {
-    if (tensor.is_nil() ||
+  inline void ResetSpace(TShape shape, VarViewMap* views,
+                         int dev_mask = kCPU, int dtype = 0) {
+    if (!initialized() ||
         shape != blob.shape ||
         dev_mask != blob.dev_mask ||
         dtype != blob.dtype) {
-      TorchState* th = TorchState::ThreadLocalState();
-      if (tensor.is_nil()) {
-        tensor = th->NewTensorEmpty(dev_mask, dtype);
+      if (dev_mask == kCPU) {
+        CHECK_EQ(dtype, kFloat32) << "only float is supported so far";
+        StorageArena* arena = StorageArena::Global();
+        memory_.reset(arena->Alloc(shape.Size() * sizeof(float)),
+                      [arena](void* ptr) { arena->Free(ptr); });
+        blob.data = memory_.get();
+        blob.shape = shape;
+        blob.dev_mask = dev_mask;
+        blob.dtype = dtype;
+        ++version;
+      } else {
+        // gpu memory can only come from torch, the session runs all
+        // gpu work on one thread, whose tensor owns the memory.
+        TorchState* th = TorchState::ThreadLocalState();
+        VarView& view = LocalView(views, dev_mask, dtype);
+        th->ResetStorage(
+            view.tensor, th->NewStorage(shape.Size(), dev_mask, dtype), shape);
+        memory_.reset();
+        this->blob = th->GetTBlob(view.tensor);
+        view.version = ++version;
       }
+    }
+  }
+  // use external cpu memory as the content, kept alive by owner.
+  inline void BindMemory(const TBlob& data, std::shared_ptr<void> owner) {
+    CHECK_EQ(data.dev_mask, kCPU);
+    memory_ = std::move(owner);
+    this->blob = data;
+    ++version;
+  }
+  // the tensor of the variable in the lua state of current thread.
+  inline LuaRef tensor(VarViewMap* views) {
+    VarView& view = LocalView(views, blob.dev_mask, blob.dtype);
+    if (view.version != version) {
+      TorchState* th = TorchState::ThreadLocalState();
       th->ResetStorage(
-          tensor, th->NewStorage(shape.Size(), dev_mask, dtype), shape);
-      this->blob = th->GetTBlob(tensor);
+          view.tensor,
+          th->NewStorageShared(blob.data, blob.shape.Size(), blob.dev_mask),
+          blob.shape);
+      view.version = version;
+    }
+    return view.tensor;
+  }
+
+ private:
+  // get the view of current thread, create an empty tensor if not exist.
+  inline VarView& LocalView(VarViewMap* views, int dev_mask, int dtype) {
+    VarView& view = (*views)[this];
+    if (view.tensor.is_nil()) {
+      view.tensor = TorchState::ThreadLocalState()->NewTensorEmpty(dev_mask, dtype);
     }
+    return view;
   }
+  // holds the cpu memory of the variable, empty on gpu.
+  std::shared_ptr<void> memory_;
 };
 
+/*!
+ * \brief reader writer lock of the variables in a session.
+ *  Writers are preferred, so a stream of readers cannot starve them.
+ */
+class RWLock {
+ public:
+  void LockShared() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !writing_ && num_writer_waiting_ == 0; });
+    ++num_reader_;
+  }
+  void UnlockShared() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--num_reader_ == 0) cv_.notify_all();
+  }
+  void Lock() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++num_writer_waiting_;
+    cv_.wait(lock, [this]() { return !writing_ && num_reader_ == 0; });
+    --num_writer_waiting_;
+    writing_ = true;
+  }
+  void Unlock() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writing_ = false;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t num_reader_{0};
+  size_t num_writer_waiting_{0};
+  bool writing_{false};
+};
 
 // shared variable map structure
 using VarStateMap = std::unordered_map<std::string, std::shared_ptr<VarState> >;
 // operator executor closures
 using FOpExec = std::function<void()>;
 
+/*!
+ * \brief set the number of threads torch uses on this thread within a scope,
+ *  other sessions running on the thread keep their own setting.
+ */
+class TorchThreadsScope {
+ public:
+  // fset sets the number and returns the previous one, 0 leaves it unchanged.
+  TorchThreadsScope(const LuaRef& fset, int num_threads) : fset_(fset) {
+    if (num_threads != 0) prev_ = fset_(num_threads).Get<int>();
+  }
+  ~TorchThreadsScope() {
+    if (prev_ != 0) fset_(prev_);
+  }
+
+ private:
+  const LuaRef& fset_;
+  int prev_{0};
+};
+
+/*!
+ * \brief memory borrowed by executors for activations while they run.
+ *  The content is not kept between runs, so executors that never run
+ *  at the same time can share one arena.
+ */
+class ActivationArena {
+ public:
+  // alignment of each block in bytes.
+  static const size_t kAlign = 64;
+  ~ActivationArena() {
+    free(data_);
+  }
+  // get memory of at least size bytes, grows to the largest request.
+  inline void* Reserve(size_t size) {
+    if (size > capacity_) {
+      free(data_);
+      data_ = nullptr;
+      CHECK_EQ(posix_memalign(&data_, kAlign, size), 0)
+          << "failed to allocate arena of " << size << " bytes";
+      capacity_ = size;
+    }
+    return data_;
+  }
+  // current size in bytes.
+  inline size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  void* data_{nullptr};
+  size_t capacity_{0};
+};
+
+// memory used by an executor.
+struct ExecMemory {
+  // bytes of each storage id in the activation pool.
+  std::vector<size_t> storage_bytes;
+  // total bytes of the activation pool.
+  size_t pool_bytes{0};
+  // whether the pool is placed in the arena of the thread.
+  bool in_arena{false};
+  // peak bytes of live storages when the plan runs in order.
+  size_t planned_peak_bytes{0};
+  // bytes of the cpu buffers staging the outputs.
+  size_t output_bytes{0};
+  // number of plans kept for other input shapes.
+  size_t num_cached_plans{0};
+  // pool and output bytes of the cached plans.
+  size_t cached_plan_bytes{0};
+  inline void Save(dmlc::JSONWriter* writer) const {
+    writer->BeginObject();
+    writer->WriteObjectKeyValue("storage_bytes", storage_bytes);
+    writer->WriteObjectKeyValue("pool_bytes", pool_bytes);
+    writer->WriteObjectKeyValue("in_arena", in_arena);
+    writer->WriteObjectKeyValue("planned_peak_bytes", planned_peak_bytes);
+    writer->WriteObjectKeyValue("output_bytes", output_bytes);
+    writer->WriteObjectKeyValue("num_cached_plans", num_cached_plans);
+    writer->WriteObjectKeyValue("cached_plan_bytes", cached_plan_bytes);
+    writer->EndObject();
+  }
+};
+
+// options of executors, decided by the session.
+struct ExecOption {
+  // The device of the executor
+  int dev_mask{kCPU};
+  // whether to enable fusion
+  bool enable_fusion{false};
+  // whether to run independent native operators in parallel
+  bool parallel{false};
+  // maximum number of threads used by each operator, 0 means no limit.
+  int num_threads{0};
+  // maximum number of plans kept for different input shapes.
+  size_t plan_cache_size{4};
+  // plan storage for this batch size, smaller batches run in views of it.
+  uint32_t max_batch{0};
+  // whether to place activations in an arena shared by the executors.
+  bool use_arena{true};
+  // the arena shared by executors of the thread.
+  ActivationArena* arena{nullptr};
+  // views of the variables in the thread of the executor.
+  VarViewMap* var_views{nullptr};
+  // records the time of operators and setup phases, nullptr if not profiling.
+  Profiler* profiler{nullptr};
+};
+
+/*!
+ * \brief parse the session option string.
+ *  Tokens are separated by space or comma,
+ *  "key=value" maps key to value, a plain token maps to empty string.
+ */
+inline std::unordered_map<std::string, std::string>
+ParseSessionOption(const std::string& option) {
+  std::unordered_map<std::string, std::string> ret;
+  size_t begin = 0;
+  while (begin <= option.length()) {
+    size_t end = option.find_first_of(" ,", begin);
+    if (end == std::string::npos) end = option.length();
+    std::string token = option.substr(begin, end - begin);
+    if (token.length() != 0) {
+      size_t eq = token.find('=');
+      if (eq == std::string::npos) {
+        ret[token] = "";
+      } else {
+        ret[token.substr(0, eq)] = token.substr(eq + 1);
+      }
+    }
+    begin = end + 1;
+  }
+  return ret;
+}
+
+// entry to store cached executor
+struct ExecEntry {
+  nnvm::Symbol cached_symbol;
+  std::shared_ptr<TorchExecutor> exec;
+  size_t use_count{0};
+  // logical time of last use.
+  size_t last_used{0};
+};
+
+// executor cache of a thread.
+struct ExecCache {
+  // only changed by the owner thread, under mutex.
+  std::unordered_map<uint64_t, ExecEntry> execs;
+  // protects execs from readers of other threads.
+  std::mutex mutex;
+  // logical clock to track recency.
+  size_t clock{0};
+  // activation memory shared by the executors.
+  ActivationArena arena;
+};
+
+struct ThreadContext;
+
+// the thread contexts of a session, shared with the threads.
+struct ThreadContextList {
+  // protects contexts and alive.
+  std::mutex mutex;
+  std::unordered_set<ThreadContext*> contexts;
+  // false once the session is destroyed.
+  std::atomic<bool> alive{true};
+};
+
+/*!
+ * \brief lua objects of a session in one thread: the executors and
+ *  the views of the variables. They are owned by the thread, and
+ *  destroyed by it when it exits or finds the session destroyed.
+ */
+struct ThreadContext {
+  ExecCache cache;
+  VarViewMap views;
+  // the list of the session, which the context leaves when destroyed.
+  std::shared_ptr<ThreadContextList> list;
+  ~ThreadContext() {
+    std::lock_guard<std::mutex> lock(list->mutex);
+    list->contexts.erase(this);
+  }
+};
+
+/*!
+ * \brief the thread contexts of current thread, by session id.
+ *  Destroyed at thread exit, before the lua state of the thread.
+ */
+class ThreadContextMap {
+ public:
+  // get the context of the session, create it if not exist.
+  ThreadContext* Get(uint64_t session_id,
+                     const std::shared_ptr<ThreadContextList>& list) {
+    // drop contexts of the sessions destroyed since the last check.
+    uint64_t epoch = ClosedEpoch().load();
+    if (epoch != epoch_) {
+      epoch_ = epoch;
+      for (auto it = contexts_.begin(); it != contexts_.end();) {
+        if (it->second->list->alive.load()) {
+          ++it;
+        } else {
+          it = contexts_.erase(it);
+        }
+      }
+    }
+    std::unique_ptr<ThreadContext>& ctx = contexts_[session_id];
+    if (ctx == nullptr) {
+      ctx.reset(new ThreadContext());
+      ctx->list = list;
+      std::lock_guard<std::mutex> lock(list->mutex);
+      list->contexts.insert(ctx.get());
+    }
+    return ctx.get();
+  }
+  // destroy the context of the session in current thread.
+  void Erase(uint64_t session_id) {
+    contexts_.erase(session_id);
+  }
+  // called when a session is destroyed, its contexts are dropped lazily.
+  static void NotifyClosed() {
+    ++ClosedEpoch();
+  }
+  // the map of current thread, created on first use.
+  static ThreadContextMap* ThreadLocal(Profiler* profiler) {
+    ThreadContextMap*& inst = Current();
+    if (inst == nullptr) {
+      {
+        // the first use in a thread loads torch and nn.
+        ProfilePhase phase(profiler, "TorchState");
+        // the torch state is created first, so it is destroyed after the map.
+        TorchState::ThreadLocalState();
+      }
+      static thread_local ThreadContextMap map;
+      inst = &map;
+    }
+    return inst;
+  }
+  // the map of current thread, nullptr if not yet used.
+  static ThreadContextMap*& Current() {
+    static thread_local ThreadContextMap* inst = nullptr;
+    return inst;
+  }
+
+ private:
+  static std::atomic<uint64_t>& ClosedEpoch() {
+    static std::atomic<uint64_t> epoch{0};
+    return epoch;
+  }
+  std::unordered_map<uint64_t, std::unique_ptr<ThreadContext> > contexts_;
+  // value of ClosedEpoch at the last check.
+  uint64_t epoch_{0};
+};
+
 // torch session.
 class TorchSession : public Session {
  public:
   // simple session that binds to one device.
-  explicit TorchSession(const std::string& config) {
-    if (config.find("gpu") != std::string::npos) {
-      default_dev_mask_ = kGPU;
-      if (config.find("fusion") != std::string::npos) {
-        enable_fusion_ = true;
+  explicit TorchSession(const std::string& config)
+      : id_(NextId()), contexts_(std::make_shared<ThreadContextList>()) {
+    auto opts = ParseSessionOption(config);
+    if (opts.count("gpu")) {
+      exec_option_.dev_mask = kGPU;
+      if (opts.count("fusion")) {
+        exec_option_.enable_fusion = true;
       }
     }
+    if (opts.count("parallel")) {
+      exec_option_.parallel = true;
+    }
+    if (opts.count("threads")) {
+      exec_option_.num_threads = std::stoi(opts.at("threads"));
+      CHECK_GE(exec_option_.num_threads, 1) << "threads must be positive";
+    }
+    if (opts.count("plan_cache_size")) {
+      exec_option_.plan_cache_size = std::stoul(opts.at("plan_cache_size"));
+      CHECK_GE(exec_option_.plan_cache_size, 1U) << "plan_cache_size must be positive";
+    }
+    if (opts.count("arena")) {
+      exec_option_.use_arena = (opts.at("arena") != "0");
+    }
+    if (opts.count("profile") || opts.count("trace")) {
+      profiler_.reset(new Profiler(opts.count("trace") != 0));
+      exec_option_.profiler = profiler_.get();
+    }
+    if (opts.count("max_batch")) {
+      exec_option_.max_batch = std::stoul(opts.at("max_batch"));
+    }
+    if (opts.count("cache_size")) {
+      cache_capacity_ = std::stoul(opts.at("cache_size"));
+      CHECK_GE(cache_capacity_, 1U) << "cache_size must be positive";
+    }
+    if (opts.count("cache_policy")) {
+      const std::string& policy = opts.at("cache_policy");
+      CHECK(policy == "lru" || policy == "lfu")
+          << "cache_policy can only be lru or lfu";
+      cache_lfu_ = (policy == "lfu");
+    }
   }
   const std::vector<TBlob>&
   Run(nnvm::Symbol* sym,
       const std::unordered_map<std::string, TBlob>& inputs) override;
+  const std::vector<TBlob>&
+  Run(nnvm::Symbol* sym,
+      const std::unordered_map<std::string, TBlob>& inputs,
+      const std::vector<TBlob>& outputs) override;
+  std::future<RunResult>
+  RunAsync(nnvm::Symbol* sym,
+           const std::unordered_map<std::string, TBlob>& inputs) override;
+  void Save(const std::string& fname) override;
+  void Load(const std::string& fname) override;
+  std::string GetProfile(bool reset) override;
+  std::string GetMemoryReport() override;
+  void DumpTrace(const std::string& fname) override;
+  ~TorchSession();
 
  private:
-  // entry to store cached executor
-  struct ExecEntry {
-    nnvm::Symbol cached_symbol;
-    std::shared_ptr<TorchExecutor> exec;
-    size_t use_count{0};
+  // unique id of a new session, never reused.
+  static uint64_t NextId() {
+    static std::atomic<uint64_t> next{0};
+    return ++next;
+  }
+  // get the lua objects of the session in current thread.
+  ThreadContext* LocalContext();
+  // get a cached executor of the symbol, or create a new one.
+  TorchExecutor* GetExecutor(nnvm::Symbol* sym);
+  // remove one executor from cache according to the policy.
+  void EvictExec(ExecCache* cache);
+  // request submitted by RunAsync.
+  struct AsyncRequest {
+    nnvm::Symbol symbol;
+    std::unordered_map<std::string, TBlob> inputs;
+    // copy of the fed data.
+    std::vector<std::vector<float> > feed_data;
+    std::promise<RunResult> result;
   };
-  int default_dev_mask_{kCPU};
-  bool enable_fusion_{false};
+  // submit a task to async_thread_, tasks run in order.
+  void SubmitAsync(std::function<void()> task);
+  // carry out the submitted tasks in order, runs in async_thread_.
+  void AsyncLoop();
+  // wait until all the submitted tasks finish, no-op in async_thread_.
+  void WaitAsync();
+  // whether current thread is async_thread_.
+  bool InAsyncThread();
+  // whether the lua work must go to async_thread_ from current thread.
+  // gpu sessions run all lua work on async_thread_, because the memory
+  // of variables is owned by a lua tensor of the thread that allocates it.
+  bool NeedAsyncThread();
+  // run f in async_thread_ and wait for it.
+  void RunInAsyncThread(const std::function<void()>& f);
+  // run executor of the symbol with variables locked.
+  const std::vector<TBlob>&
+  RunExecutor(nnvm::Symbol* sym,
+              const std::unordered_map<std::string, TBlob>& inputs,
+              const std::vector<TBlob>* outputs);
+  // options passed to executors.
+  ExecOption exec_option_;
+  // maximum number of cached executors.
+  size_t cache_capacity_{4};
+  // evict least frequently used executor instead of least recently used.
+  bool cache_lfu_{false};
   // local cached variable states.
   VarStateMap states_;
-  // cached executor
-  std::unordered_map<uint64_t, ExecEntry> cached_execs_;
+  // lock of the variables, executors that assign variables hold it exclusively.
+  RWLock var_lock_;
+  // protects states_.
+  std::mutex mutex_;
+  // profiler shared by the executors, when profiling is on.
+  std::unique_ptr<Profiler> profiler_;
+  // id of the session in the thread contexts.
+  uint64_t id_;
+  // contexts of the threads that used the session, each holds the
+  // cached executors and variable views of its thread.
+  std::shared_ptr<ThreadContextList> contexts_;
+  // thread to carry out asynchronous runs, started on first use.
+  std::thread async_thread_;
+  // submitted tasks not yet started.
+  std::deque<std::function<void()> > async_queue_;
+  // number of submitted tasks not yet finished.
+  size_t async_pending_{0};
+  bool async_stop_{false};
+  std::mutex async_mutex_;
+  std::condition_variable async_cv_;
 };
 
 
 class TorchExecutor {
  public:
+  // destroyed by the thread that created it, as the lua objects.
+  ~TorchExecutor();
   // initialize the executor
   // possibly update the states.
-  void Init(nnvm::Symbol symbol, VarStateMap* states, int default_dev_mask, bool enable_fusion);
+  void Init(nnvm::Symbol symbol, VarStateMap* states, const ExecOption& option);
   /// run the executor, return the outputs.
-  const std::vector<TBlob>& Run(const std::unordered_map<std::string, TBlob>& inputs);
+  /// when out_buffers is given, outputs are written into the buffers.
+  const std::vector<TBlob>& Run(const std::unordered_map<std::string, TBlob>& inputs,
+                                const std::vector<TBlob>* out_buffers = nullptr);
   // return corresponding internal symbol
   inline const nnvm::Symbol& symbol() const {
     return symbol_;
   }
+  // whether the executor can change the variables.
+  inline bool mutate_variables() const {
+    return assign_var_nids_.size() != 0;
+  }
+  // memory used by the executor.
+  ExecMemory GetMemory() const;
 
  private:
   // setup the executor space.
@@ -109,8 +586,80 @@ class TorchExecutor {
   void ClearAuxiliaryMembers();
   void Setup(const std::unordered_map<std::string, TBlob>& inputs);
   void SetupShapeDType(const std::unordered_map<std::string, TBlob>& inputs, bool* need_redo_infer);
+  // whether the current shapes and types match the inputs.
+  bool ShapeDTypeMatch(const std::unordered_map<std::string, TBlob>& inputs);
+  // infer shapes and types, replace leading dim of placeholders by batch if not 0.
+  void InferShapeDType(const std::unordered_map<std::string, TBlob>& inputs, uint32_t batch);
+  // batch size of the inputs if they can run in the plan of max batch, 0 otherwise.
+  uint32_t PlanBatch(const std::unordered_map<std::string, TBlob>& inputs);
+  // point entries to the leading part of the storage planned for max batch.
+  void SetupBatchViews();
+  // batch size of the current views of the plan.
+  uint32_t ViewBatch() const;
+  // keep the current views in cache, switch to the views of the batch size.
+  // return false if the views are not cached and need to be created.
+  bool SwitchBatchViews(uint32_t batch);
+  // point the storage pool into the arena, if it has moved.
+  void BindArena();
+  // keep the current plan in cache, switch to the plan of the inputs.
+  // return false if the plan is not cached and need to be created.
+  bool SwitchPlan(const std::unordered_map<std::string, TBlob>& inputs);
+  // signature of the shapes and types the plan depends on.
+  std::string InputSignature(const std::unordered_map<std::string, TBlob>& inputs);
   void SetupStorage();
   void SetupOpExecs();
+  void SetupSchedule();
+  // compile op_execs_ into the dense exec_plan_.
+  void SetupExecPlan();
+  // point bindable outputs to buffers, or back to planned memory if nullptr.
+  void BindOutputMemory(const std::vector<TBlob>* buffers);
+  // run the closure of node nid, record its time when profiling.
+  inline void ExecOp(uint32_t nid, const FOpExec& fexec) {
+    if (profiler_ == nullptr) {
+      fexec();
+      return;
+    }
+    double begin = Profiler::NowMicros();
+    fexec();
+    double end = Profiler::NowMicros();
+    const auto& idx = graph_.indexed_graph();
+    const Node* node = idx[nid].source;
+    profiler_->AddOp(node->op()->name, node->attrs.name, end - begin);
+    if (profiler_->trace()) {
+      std::vector<uint32_t> eids;
+      for (uint32_t i = 0; i < node->num_outputs(); ++i) {
+        eids.push_back(idx.entry_id(nid, i));
+      }
+      Trace(node->attrs.name, node->op()->name, eids, begin, end);
+    }
+  }
+  // record a trace event on the given entries.
+  void Trace(const std::string& name, const std::string& cat,
+             const std::vector<uint32_t>& eids, double begin, double end);
+  // copy from to, record a trace event on entry eid when tracing.
+  inline void CopyTraced(const LuaRef& from, const LuaRef& to,
+                         const std::string& name, uint32_t eid) {
+    auto* th = TorchState::ThreadLocalState();
+    if (profiler_ == nullptr || !profiler_->trace()) {
+      th->CopyFromTo(from, to);
+      return;
+    }
+    double begin = Profiler::NowMicros();
+    th->CopyFromTo(from, to);
+    Trace(name, "copy", {eid}, begin, Profiler::NowMicros());
+  }
+  // run the steps of exec_plan_ one by one.
+  void RunOps();
+  // run the operators as their dependencies are resolved,
+  // native operators run on the worker pool, others and the copies
+  // of placeholders on this thread.
+  // With num_threads_ = N at most N operators run at the same time,
+  // N - 1 pool tasks and this thread, which also takes native operators.
+  void RunOpsParallel();
+  void ScheduleOp(uint32_t nid);
+  void ExecScheduledOp(uint32_t nid);
+  // pool task running nid, then the native operators queued meanwhile.
+  void RunPoolTask(uint32_t nid);
 #if TINYFLOW_USE_FUSION == 1
   FOpExec GenerateRTCClosure(RTC& rtc,
           const std::vector<LuaRef>& input_luaref, std::vector<LuaRef>& output_luaref);
@@ -120,6 +669,8 @@ class TorchExecutor {
   nnvm::Graph graph_;
   // variable states map.
   VarStateMap* var_states_;
+  // views of the variables in the thread of the executor.
+  VarViewMap* var_views_{nullptr};
   // shape vector in graph attribute
   const ShapeVector* node_shape_{nullptr};
   // type vector in graph attribute
@@ -134,11 +685,31 @@ class TorchExecutor {
   int dev_mask_{kGPU};
   // whether to enable fusion
   bool enable_fusion_;
+  // maximum number of plans, including the current one.
+  size_t plan_cache_size_{1};
+  // batch size storage is planned for, 0 to plan for the fed shapes.
+  uint32_t max_batch_{0};
+  // arena to borrow the storage pool from, nullptr if the executor owns it.
+  ActivationArena* arena_{nullptr};
+  // arena memory the storage pool currently points to.
+  char* arena_base_{nullptr};
+  // whether to run independent native operators in parallel
+  bool parallel_{false};
+  // maximum number of threads used by each operator, 0 means no limit.
+  int num_threads_{0};
+  // lua function to set number of threads used by torch, returns the previous one.
+  LuaRef fset_torch_threads_;
+  // records the time of operators, nullptr if not profiling.
+  Profiler* profiler_{nullptr};
   // node id of place holder ops
   std::vector<uint32_t> placeholder_nids_;
   // size of number of node, placeholder_tblobs_[nid].data != nullptr
   // if nid is a placeholder and the content is the corresponding TBlob to be copied in.
   std::vector<TBlob> placeholder_tblobs_;
+  // size of number of node, placeholder_bind_[nid] is not nil if nid is
+  // a placeholder that directly uses the fed memory, the content is a
+  // storage that wraps the fed memory and is rebound at each run.
+  std::vector<LuaRef> placeholder_bind_;
   // node id of variable that is assigned in this executor
   std::vector<uint32_t> assign_var_nids_;
   // node id of variable that is readed by this executor
@@ -152,68 +723,659 @@ class TorchExecutor {
   std::vector<LuaRef> data_entry_;
   // whether data entry is variable.
   std::vector<bool> data_entry_is_var_;
+  // TBlob of each data entry, referred by native compute closures.
+  std::vector<TBlob> data_blob_;
   // internal storage space.
   std::vector<LuaRef> storage_pool_;
+  // number of elements of each storage.
+  std::vector<size_t> pool_entry_size_;
+  // byte offset of each storage in the arena.
+  std::vector<size_t> pool_offset_;
+  // number of bytes needed in the arena.
+  size_t arena_bytes_{0};
   // operator executor closures
   std::vector<FOpExec> op_execs_;
   // lua module states of each operator.
   std::vector<LuaRef> op_exec_modules_;
+  // a step of the compiled execution plan.
+  struct ExecStep {
+    // node of the step.
+    uint32_t nid;
+    // entry to copy the fed placeholder nid into, kNoCopy if the step runs exec.
+    uint32_t copy_eid;
+    // operator closure.
+    FOpExec exec;
+  };
+  static const uint32_t kNoCopy = std::numeric_limits<uint32_t>::max();
+  // placeholder copies and operators that compute, in execution order.
+  std::vector<ExecStep> exec_plan_;
+  // whether op_execs_[nid] is a native closure that can run on any thread.
+  std::vector<bool> op_native_;
+  // nodes that depend on each node in parallel execution.
+  std::vector<std::vector<uint32_t> > op_successors_;
+  // number of nodes each node depends on in parallel execution.
+  std::vector<uint32_t> op_num_deps_;
+  // whether node is a placeholder copied in by a step of parallel execution.
+  std::vector<bool> op_copy_;
+  // runtime state of parallel execution.
+  struct ScheduleState {
+    // number of unfinished dependencies of each node.
+    std::unique_ptr<std::atomic<uint32_t>[]> pending;
+    // number of nodes not yet finished.
+    size_t remaining{0};
+    // nodes ready to run on the lua thread.
+    std::deque<uint32_t> lua_ready;
+    // native nodes ready while the pool tasks are at the limit.
+    std::deque<uint32_t> native_ready;
+    // number of pool tasks of this run not yet finished.
+    size_t num_tasks{0};
+    // maximum number of pool tasks, 0 means no limit.
+    size_t max_tasks{0};
+    // first error raised by an operator.
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  ScheduleState sched_;
+  // output_bind_[i] is not nil if output i can be written directly into
+  // a caller provided buffer, the content is a storage wrapping the memory
+  // of the output entry, which is rebound to the buffer during a run.
+  std::vector<LuaRef> output_bind_;
+  // the planned memory of bindable outputs.
+  std::vector<void*> output_home_;
   // The storage space to hold outputs.
   std::vector<LuaRef> outputs_;
+  std::vector<LuaRef> output_storage_;
   std::vector<TBlob> output_blobs_;
+  // ----------------------------
+  // plan cache
+  // everything that depends on the input shapes, kept for reuse.
+  struct CachedPlan {
+    nnvm::Graph graph;
+    const ShapeVector* node_shape{nullptr};
+    const DTypeVector* node_dtype{nullptr};
+    std::vector<LuaRef> data_entry;
+    std::vector<bool> data_entry_is_var;
+    std::vector<TBlob> data_blob;
+    std::vector<LuaRef> storage_pool;
+    std::vector<size_t> pool_entry_size;
+    std::vector<size_t> pool_offset;
+    size_t arena_bytes{0};
+    std::vector<LuaRef> placeholder_bind;
+    std::vector<FOpExec> op_execs;
+    std::vector<LuaRef> op_exec_modules;
+    std::vector<bool> op_native;
+    std::vector<ExecStep> exec_plan;
+    std::vector<std::vector<uint32_t> > op_successors;
+    std::vector<uint32_t> op_num_deps;
+    std::vector<bool> op_copy;
+    std::unique_ptr<std::atomic<uint32_t>[]> pending;
+    std::vector<LuaRef> output_bind;
+    std::vector<void*> output_home;
+    std::vector<LuaRef> outputs;
+    std::vector<LuaRef> output_storage;
+    // logical time of last use.
+    size_t last_used{0};
+  };
+  // exchange the current plan with the given one.
+  void SwapPlan(CachedPlan* plan);
+  // views of the current plan for one batch size, with their closures.
+  struct BatchViews {
+    // shape attribute of the graph.
+    std::shared_ptr<any> shape;
+    std::vector<LuaRef> data_entry;
+    std::vector<TBlob> data_blob;
+    std::vector<FOpExec> op_execs;
+    std::vector<ExecStep> exec_plan;
+    std::vector<LuaRef> outputs;
+    // logical time of last use.
+    size_t last_used{0};
+  };
+  // exchange the current views with the given ones.
+  void SwapBatchViews(BatchViews* views);
+  // views of the current plan for batch sizes other than the current one.
+  std::unordered_map<uint32_t, std::unique_ptr<BatchViews> > batch_views_;
+  // signature of the current plan.
+  std::string plan_signature_;
+  // plans other than the current one.
+  std::unordered_map<std::string, std::unique_ptr<CachedPlan> > cached_plans_;
+  // logical clock to track recency of plans.
+  size_t plan_clock_{0};
 };
 
 Session* Session::Create(const std::string& option) {
   return new TorchSession(option);
 }
 
+inline uint64_t HashCombine(uint64_t seed, uint64_t value) {
+  return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// whether the two symbols are made of exactly the same output nodes.
+inline bool SameOutputs(const nnvm::Symbol& a, const nnvm::Symbol& b) {
+  if (a.outputs.size() != b.outputs.size()) return false;
+  for (size_t i = 0; i < a.outputs.size(); ++i) {
+    if (a.outputs[i].node.get() != b.outputs[i].node.get() ||
+        a.outputs[i].index != b.outputs[i].index ||
+        a.outputs[i].version != b.outputs[i].version) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// list nodes in post DFS order, and the position of each node.
+inline void CanonicalOrder(const nnvm::Symbol& sym,
+                           std::vector<const Node*>* order,
+                           std::unordered_map<const Node*, uint32_t>* pos) {
+  nnvm::DFSVisit(sym.outputs, [order, pos](const nnvm::NodePtr& n) {
+      (*pos)[n.get()] = static_cast<uint32_t>(order->size());
+      order->push_back(n.get());
+    });
+}
+
+// whether the name of node matters for execution:
+// variables bind to states by name, placeholders are fed by name.
+inline bool IsNamedNode(const Node* n) {
+  static const Op* placeholder_op = Op::Get("placeholder");
+  return n->is_variable() || n->op() == placeholder_op;
+}
+
+/*!
+ * \brief structural hash of the graph.
+ *  Only depends on op, attributes, topology and the names of
+ *  variables and placeholders, so graphs rebuilt from scratch
+ *  that compute the same thing share the same hash.
+ */
+uint64_t StructuralHash(const nnvm::Symbol& sym) {
+  std::hash<std::string> hstr;
+  std::vector<const Node*> order;
+  std::unordered_map<const Node*, uint32_t> pos;
+  CanonicalOrder(sym, &order, &pos);
+  uint64_t hash_value = order.size();
+  for (const Node* n : order) {
+    uint64_t h = hstr(n->is_variable() ? std::string("null") : n->op()->name);
+    if (IsNamedNode(n)) h = HashCombine(h, hstr(n->attrs.name));
+    // dict is unordered, use an order independent combination.
+    uint64_t hdict = 0;
+    for (const auto& kv : n->attrs.dict) {
+      hdict += HashCombine(hstr(kv.first), hstr(kv.second));
+    }
+    h = HashCombine(h, hdict);
+    for (const NodeEntry& e : n->inputs) {
+      h = HashCombine(h, pos.at(e.node.get()));
+      h = HashCombine(h, e.index);
+      h = HashCombine(h, e.version);
+    }
+    for (const nnvm::NodePtr& c : n->control_deps) {
+      h = HashCombine(h, pos.at(c.get()) + 0x5bd1e995);
+    }
+    hash_value = HashCombine(hash_value, h);
+  }
+  for (const NodeEntry& e : sym.outputs) {
+    hash_value = HashCombine(hash_value, pos.at(e.node.get()));
+    hash_value = HashCombine(hash_value, e.index);
+    hash_value = HashCombine(hash_value, e.version);
+  }
+  return hash_value;
+}
+
+// whether the two symbols are structurally equivalent, see StructuralHash.
+bool StructuralEqual(const nnvm::Symbol& a, const nnvm::Symbol& b) {
+  if (a.outputs.size() != b.outputs.size()) return false;
+  std::vector<const Node*> aorder, border;
+  std::unordered_map<const Node*, uint32_t> apos, bpos;
+  CanonicalOrder(a, &aorder, &apos);
+  CanonicalOrder(b, &border, &bpos);
+  if (aorder.size() != border.size()) return false;
+  auto same_entry = [&apos, &bpos](const NodeEntry& x, const NodeEntry& y) {
+    return apos.at(x.node.get()) == bpos.at(y.node.get()) &&
+        x.index == y.index && x.version == y.version;
+  };
+  for (size_t i = 0; i < aorder.size(); ++i) {
+    const Node* x = aorder[i];
+    const Node* y = border[i];
+    if (x->op() != y->op()) return false;
+    if (IsNamedNode(x) && x->attrs.name != y->attrs.name) return false;
+    if (x->attrs.dict != y->attrs.dict) return false;
+    if (x->inputs.size() != y->inputs.size()) return false;
+    if (x->control_deps.size() != y->control_deps.size()) return false;
+    for (size_t j = 0; j < x->inputs.size(); ++j) {
+      if (!same_entry(x->inputs[j], y->inputs[j])) return false;
+    }
+    for (size_t j = 0; j < x->control_deps.size(); ++j) {
+      if (apos.at(x->control_deps[j].get()) !=
+          bpos.at(y->control_deps[j].get())) return false;
+    }
+  }
+  for (size_t i = 0; i < a.outputs.size(); ++i) {
+    if (!same_entry(a.outputs[i], b.outputs[i])) return false;
+  }
+  return true;
+}
+
 const std::vector<TBlob>& TorchSession::Run(
     nnvm::Symbol* new_sym,
     const std::unordered_map<std::string, TBlob>& inputs) {
-  // compute the hash value
-  uint64_t hash_value = new_sym->outputs.size();
-  for (NodeEntry& e : new_sym->outputs) {
-    uint64_t value = reinterpret_cast<uint64_t>(e.node.get());
-    hash_value ^= value + 0x9e3779b9 + (hash_value << 6) + (hash_value >> 2);
-  }
-  if (cached_execs_.count(hash_value) != 0) {
-    auto& entry = cached_execs_.at(hash_value);
-    const nnvm::Symbol& old_sym = entry.cached_symbol;
-    bool stale_exec = (old_sym.outputs.size() != new_sym->outputs.size());
-    if (!stale_exec) {
-      for (size_t i = 0; i < old_sym.outputs.size(); ++i) {
-        if (old_sym.outputs[i].node.get() != new_sym->outputs[i].node.get() ||
-            old_sym.outputs[i].index != new_sym->outputs[i].index ||
-            old_sym.outputs[i].version != new_sym->outputs[i].version) {
-          stale_exec = true; break;
+  if (NeedAsyncThread()) {
+    const std::vector<TBlob>* ret = nullptr;
+    RunInAsyncThread([&]() { ret = &RunExecutor(new_sym, inputs, nullptr); });
+    return *ret;
+  }
+  WaitAsync();
+  return RunExecutor(new_sym, inputs, nullptr);
+}
+
+const std::vector<TBlob>& TorchSession::Run(
+    nnvm::Symbol* new_sym,
+    const std::unordered_map<std::string, TBlob>& inputs,
+    const std::vector<TBlob>& outputs) {
+  if (NeedAsyncThread()) {
+    const std::vector<TBlob>* ret = nullptr;
+    RunInAsyncThread([&]() { ret = &RunExecutor(new_sym, inputs, &outputs); });
+    return *ret;
+  }
+  WaitAsync();
+  return RunExecutor(new_sym, inputs, &outputs);
+}
+
+std::future<RunResult> TorchSession::RunAsync(
+    nnvm::Symbol* new_sym,
+    const std::unordered_map<std::string, TBlob>& inputs) {
+  std::shared_ptr<AsyncRequest> req = std::make_shared<AsyncRequest>();
+  req->symbol = *new_sym;
+  // copy in the caller thread, overlaps with the running requests.
+  for (const auto& kv : inputs) {
+    CHECK_EQ(kv.second.dev_mask, kCPU) << "fed data must be on cpu";
+    CHECK_EQ(kv.second.dtype, kFloat32) << "only float is supported so far";
+    const float* dptr = static_cast<const float*>(kv.second.data);
+    req->feed_data.emplace_back(dptr, dptr + kv.second.shape.Size());
+    TBlob blob = kv.second;
+    blob.data = dmlc::BeginPtr(req->feed_data.back());
+    req->inputs[kv.first] = blob;
+  }
+  std::future<RunResult> ret = req->result.get_future();
+  SubmitAsync([this, req]() {
+      try {
+        const std::vector<TBlob>& out = RunExecutor(&req->symbol, req->inputs, nullptr);
+        RunResult result;
+        result.buffers.resize(out.size());
+        for (size_t i = 0; i < out.size(); ++i) {
+          const float* dptr = static_cast<const float*>(out[i].data);
+          result.buffers[i].assign(dptr, dptr + out[i].shape.Size());
+          TBlob blob = out[i];
+          blob.data = dmlc::BeginPtr(result.buffers[i]);
+          result.outputs.push_back(blob);
         }
+        req->result.set_value(std::move(result));
+      } catch (...) {
+        req->result.set_exception(std::current_exception());
       }
+    });
+  return ret;
+}
+
+void TorchSession::SubmitAsync(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (!async_thread_.joinable()) {
+      async_thread_ = std::thread([this]() { this->AsyncLoop(); });
     }
-    if (!stale_exec) {
+    async_queue_.push_back(std::move(task));
+    ++async_pending_;
+  }
+  async_cv_.notify_all();
+}
+
+void TorchSession::AsyncLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(async_mutex_);
+      async_cv_.wait(lock, [this]() {
+          return async_stop_ || !async_queue_.empty();
+        });
+      if (async_queue_.empty()) break;
+      task = std::move(async_queue_.front());
+      async_queue_.pop_front();
+    }
+    task();
+    {
+      std::lock_guard<std::mutex> lock(async_mutex_);
+      --async_pending_;
+    }
+    async_cv_.notify_all();
+  }
+  // the lua objects of the thread are released by its ThreadContextMap at exit.
+}
+
+bool TorchSession::InAsyncThread() {
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  return async_thread_.joinable() &&
+      async_thread_.get_id() == std::this_thread::get_id();
+}
+
+void TorchSession::WaitAsync() {
+  // the running task is counted, waiting for it in its thread never returns.
+  if (InAsyncThread()) return;
+  std::unique_lock<std::mutex> lock(async_mutex_);
+  async_cv_.wait(lock, [this]() { return async_pending_ == 0; });
+}
+
+bool TorchSession::NeedAsyncThread() {
+  return exec_option_.dev_mask != kCPU && !InAsyncThread();
+}
+
+void TorchSession::RunInAsyncThread(const std::function<void()>& f) {
+  std::promise<void> done;
+  std::future<void> ret = done.get_future();
+  SubmitAsync([&f, &done]() {
+      try {
+        f();
+        done.set_value();
+      } catch (...) {
+        done.set_exception(std::current_exception());
+      }
+    });
+  ret.get();
+}
+
+TorchSession::~TorchSession() {
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    async_stop_ = true;
+  }
+  async_cv_.notify_all();
+  // the worker releases its lua objects when it exits.
+  if (async_thread_.joinable()) async_thread_.join();
+  contexts_->alive = false;
+  // other threads drop their contexts of the session on their next use
+  // of any session, or when they exit.
+  ThreadContextMap::NotifyClosed();
+  ThreadContextMap* map = ThreadContextMap::Current();
+  if (map != nullptr) map->Erase(id_);
+}
+
+const std::vector<TBlob>& TorchSession::RunExecutor(
+    nnvm::Symbol* new_sym,
+    const std::unordered_map<std::string, TBlob>& inputs,
+    const std::vector<TBlob>* outputs) {
+  TorchExecutor* exec = GetExecutor(new_sym);
+  // executors that only read variables can run concurrently.
+  bool exclusive = exec->mutate_variables();
+  if (exclusive) {
+    var_lock_.Lock();
+  } else {
+    var_lock_.LockShared();
+  }
+  try {
+    const std::vector<TBlob>& ret = exec->Run(inputs, outputs);
+    if (exclusive) {
+      var_lock_.Unlock();
+    } else {
+      var_lock_.UnlockShared();
+    }
+    return ret;
+  } catch (...) {
+    if (exclusive) {
+      var_lock_.Unlock();
+    } else {
+      var_lock_.UnlockShared();
+    }
+    throw;
+  }
+}
+
+void TorchSession::Save(const std::string& fname) {
+  if (NeedAsyncThread()) {
+    RunInAsyncThread([this, &fname]() { this->Save(fname); });
+    return;
+  }
+  WaitAsync();
+  VarViewMap* views = &LocalContext()->views;
+  std::lock_guard<std::mutex> lock(mutex_);
+  var_lock_.LockShared();
+  try {
+    TorchState* th = TorchState::ThreadLocalState();
+    std::vector<std::pair<std::string, TBlob> > vars;
+    // staging of variables not on cpu.
+    std::vector<std::vector<float> > buffers;
+    for (const auto& kv : states_) {
+      VarState* state = kv.second.get();
+      if (!state->initialized()) continue;
+      TBlob blob = state->blob;
+      if (blob.dev_mask != kCPU) {
+        buffers.emplace_back(blob.shape.Size());
+        blob.data = dmlc::BeginPtr(buffers.back());
+        blob.dev_mask = kCPU;
+        th->CopyFromTo(state->tensor(views), th->NewTensorShared(blob));
+      }
+      vars.emplace_back(kv.first, blob);
+    }
+    SaveCheckpoint(fname, vars);
+  } catch (...) {
+    var_lock_.UnlockShared();
+    throw;
+  }
+  var_lock_.UnlockShared();
+}
+
+void TorchSession::Load(const std::string& fname) {
+  if (NeedAsyncThread()) {
+    RunInAsyncThread([this, &fname]() { this->Load(fname); });
+    return;
+  }
+  std::shared_ptr<MappedCheckpoint> ckpt = std::make_shared<MappedCheckpoint>(fname);
+  WaitAsync();
+  VarViewMap* views = &LocalContext()->views;
+  std::lock_guard<std::mutex> lock(mutex_);
+  var_lock_.Lock();
+  try {
+    TorchState* th = TorchState::ThreadLocalState();
+    for (const auto& kv : ckpt->vars()) {
+      std::shared_ptr<VarState>& state = states_[kv.first];
+      if (state == nullptr) state = std::make_shared<VarState>();
+      if (exec_option_.dev_mask == kCPU) {
+        // use the mapped pages directly, the mapping lives as long
+        // as a variable points into it.
+        state->BindMemory(kv.second, std::shared_ptr<void>(ckpt, kv.second.data));
+      } else {
+        state->ResetSpace(kv.second.shape, views, exec_option_.dev_mask, kv.second.dtype);
+        th->CopyFromTo(th->NewTensorShared(kv.second), state->tensor(views));
+      }
+    }
+  } catch (...) {
+    var_lock_.Unlock();
+    throw;
+  }
+  var_lock_.Unlock();
+}
+
+std::string TorchSession::GetProfile(bool reset) {
+  CHECK(profiler_ != nullptr)
+      << "profiling is off, create the session with option profile";
+  // wait for the submitted runs to be recorded.
+  WaitAsync();
+  std::string ret = profiler_->ToJSON();
+  if (reset) profiler_->Clear();
+  return ret;
+}
+
+std::string TorchSession::GetMemoryReport() {
+  WaitAsync();
+  std::lock_guard<std::mutex> lock(mutex_);
+  // no executor runs while holding the variables exclusively.
+  var_lock_.Lock();
+  std::map<std::string, size_t> var_bytes;
+  size_t total_var_bytes = 0;
+  for (const auto& kv : states_) {
+    if (!kv.second->initialized()) continue;
+    size_t bytes = kv.second->blob.shape.Size() * sizeof(float);
+    var_bytes[kv.first] = bytes;
+    total_var_bytes += bytes;
+  }
+  std::vector<ExecMemory> execs;
+  size_t arena_bytes = 0, activation_bytes = 0;
+  size_t output_bytes = 0, planned_peak_bytes = 0;
+  // a context stays in the list until it is destroyed, under the list lock.
+  std::lock_guard<std::mutex> list_lock(contexts_->mutex);
+  for (ThreadContext* ctx : contexts_->contexts) {
+    ExecCache* cache = &ctx->cache;
+    std::lock_guard<std::mutex> cache_lock(cache->mutex);
+    arena_bytes += cache->arena.capacity();
+    for (const auto& ekv : cache->execs) {
+      ExecMemory mem = ekv.second.exec->GetMemory();
+      // pools in the arena are counted by the arena.
+      if (!mem.in_arena) activation_bytes += mem.pool_bytes;
+      activation_bytes += mem.cached_plan_bytes;
+      output_bytes += mem.output_bytes;
+      planned_peak_bytes = std::max(planned_peak_bytes, mem.planned_peak_bytes);
+      execs.emplace_back(std::move(mem));
+    }
+  }
+  activation_bytes += arena_bytes;
+  var_lock_.Unlock();
+
+  std::ostringstream os;
+  dmlc::JSONWriter writer(&os);
+  writer.BeginObject();
+  writer.WriteObjectKeyValue("variables", var_bytes);
+  writer.WriteObjectKeyValue("variable_bytes", total_var_bytes);
+  writer.WriteObjectKeyValue("arena_bytes", arena_bytes);
+  writer.WriteObjectKeyValue("activation_bytes", activation_bytes);
+  writer.WriteObjectKeyValue("output_bytes", output_bytes);
+  writer.WriteObjectKeyValue("planned_peak_bytes", planned_peak_bytes);
+  writer.WriteObjectKeyValue(
+      "total_bytes", total_var_bytes + activation_bytes + output_bytes);
+  writer.WriteObjectKeyValue("executors", execs);
+  // process wide, shared by all sessions.
+  writer.WriteObjectKeyValue("storage_arena", StorageArena::Global()->GetStats());
+  writer.EndObject();
+  return os.str();
+}
+
+void TorchSession::DumpTrace(const std::string& fname) {
+  CHECK(profiler_ != nullptr && profiler_->trace())
+      << "tracing is off, create the session with option trace";
+  WaitAsync();
+  std::ofstream os(fname.c_str());
+  CHECK(os.good()) << "cannot open " << fname << " to write";
+  profiler_->WriteTrace(&os);
+  CHECK(os.good()) << "failed to write " << fname;
+}
+
+ThreadContext* TorchSession::LocalContext() {
+  return ThreadContextMap::ThreadLocal(profiler_.get())->Get(id_, contexts_);
+}
+
+TorchExecutor* TorchSession::GetExecutor(nnvm::Symbol* new_sym) {
+  ThreadContext* ctx = LocalContext();
+  ExecCache* cache = &ctx->cache;
+  auto& cached_execs = cache->execs;
+  // the cache is only changed by this thread, the lock keeps out the
+  // readers of other threads, and is not held while taking mutex_.
+  std::unique_lock<std::mutex> cache_lock(cache->mutex);
+  // fast path, exactly the same symbol as a cached one.
+  for (auto& kv : cached_execs) {
+    ExecEntry& entry = kv.second;
+    if (SameOutputs(entry.cached_symbol, *new_sym)) {
       ++entry.use_count;
-      return entry.exec->Run(inputs);
+      entry.last_used = ++cache->clock;
+      return entry.exec.get();
+    }
+  }
+  // structurally equivalent symbol can reuse the executor.
+  uint64_t hash_value = StructuralHash(*new_sym);
+  auto it = cached_execs.find(hash_value);
+  if (it != cached_execs.end()) {
+    ExecEntry& entry = it->second;
+    if (StructuralEqual(entry.cached_symbol, *new_sym)) {
+      // remember the new symbol so the fast path hits next time.
+      entry.cached_symbol = *new_sym;
+      ++entry.use_count;
+      entry.last_used = ++cache->clock;
+      return entry.exec.get();
     } else {
-      cached_execs_.erase(hash_value);
+      cached_execs.erase(it);
     }
   }
-  // dump technique, remove all previous executors
-  // better strategy, LRU?
-  cached_execs_.clear();
+  while (cached_execs.size() >= cache_capacity_) {
+    EvictExec(cache);
+  }
+  cache_lock.unlock();
   ExecEntry e;
   e.cached_symbol = *new_sym;
   e.exec = std::make_shared<TorchExecutor>();
-  e.exec->Init(*new_sym, &states_, default_dev_mask_, enable_fusion_);
-  cached_execs_[hash_value] = e;
-  return e.exec->Run(inputs);
+  {
+    // Init can add new variables to states_.
+    std::lock_guard<std::mutex> lock(mutex_);
+    ExecOption option = exec_option_;
+    if (option.use_arena) option.arena = &cache->arena;
+    option.var_views = &ctx->views;
+    e.exec->Init(*new_sym, &states_, option);
+  }
+  cache_lock.lock();
+  e.use_count = 1;
+  e.last_used = ++cache->clock;
+  cached_execs[hash_value] = e;
+  return e.exec.get();
+}
+
+void TorchSession::EvictExec(ExecCache* cache) {
+  auto& cached_execs = cache->execs;
+  auto victim = cached_execs.end();
+  for (auto it = cached_execs.begin(); it != cached_execs.end(); ++it) {
+    if (victim == cached_execs.end()) {
+      victim = it; continue;
+    }
+    const ExecEntry& a = it->second;
+    const ExecEntry& b = victim->second;
+    if (cache_lfu_ && a.use_count != b.use_count) {
+      if (a.use_count < b.use_count) victim = it;
+    } else if (a.last_used < b.last_used) {
+      victim = it;
+    }
+  }
+  if (victim != cached_execs.end()) {
+    cached_execs.erase(victim);
+  }
+}
+
+TorchExecutor::~TorchExecutor() {
+  // give the storages back to the arena now, not when lua collects them.
+  TorchState* th = TorchState::ThreadLocalState();
+  th->ReleaseStorage(&storage_pool_);
+  for (auto& kv : cached_plans_) {
+    th->ReleaseStorage(&kv.second->storage_pool);
+  }
 }
 
 void TorchExecutor::Init(nnvm::Symbol symbol,
                          VarStateMap* states,
-                         int default_dev_mask,
-                         bool enable_fusion) {
-  dev_mask_ = default_dev_mask;
+                         const ExecOption& option) {
+  profiler_ = option.profiler;
+  var_views_ = option.var_views;
+  dev_mask_ = option.dev_mask;
   if (dev_mask_ == kGPU) TorchState::ThreadLocalState()->InitGPU();
-  enable_fusion_ = enable_fusion;
+  enable_fusion_ = option.enable_fusion;
+  // fusion changes the graph, plans can not be swapped.
+  plan_cache_size_ = enable_fusion_ ? 1 : option.plan_cache_size;
+  max_batch_ = enable_fusion_ ? 0 : option.max_batch;
+  // the arena rebinds cpu storages.
+  arena_ = (dev_mask_ == kCPU ? option.arena : nullptr);
+  num_threads_ = option.num_threads;
+  // only native operators on cpu can run outside the lua thread.
+  parallel_ = option.parallel && dev_mask_ == kCPU && num_threads_ != 1;
+  if (num_threads_ != 0) {
+    fset_torch_threads_ = TorchState::ThreadLocalState()->GetFunction(
+        "set_torch_threads", R"(
+      return function(n)
+        local prev = torch.getnumthreads()
+        torch.setnumthreads(n)
+        return prev
+      end
+    )");
+  }
   graph_.outputs = symbol.outputs;
   symbol_.outputs = graph_.outputs;
   var_states_ = states;
@@ -265,49 +1427,299 @@ void TorchExecutor::SetupAuxiliaryMembers() {
 void TorchExecutor::ClearAuxiliaryMembers() {
   placeholder_nids_.clear();
   placeholder_tblobs_.clear();
+  placeholder_bind_.clear();
   assign_var_nids_.clear();
   read_var_nids_.clear();
   node_states_.clear();
 }
 
 const std::vector<TBlob>&
-TorchExecutor::Run(const std::unordered_map<std::string, TBlob>& inputs) {
-  Setup(inputs);
+TorchExecutor::Run(const std::unordered_map<std::string, TBlob>& inputs,
+                   const std::vector<TBlob>* out_buffers) {
   {
+    ProfilePhase phase(profiler_, "Setup");
+    Setup(inputs);
+  }
+  const auto& idx = graph_.indexed_graph();
+  auto* th = TorchState::ThreadLocalState();
+  if (out_buffers != nullptr) {
+    CHECK_EQ(out_buffers->size(), outputs_.size())
+        << "number of output buffers mismatch";
+    for (size_t i = 0; i < outputs_.size(); ++i) {
+      const TShape& shape = node_shape_->at(idx.entry_id(idx.outputs()[i]));
+      const TBlob& buf = out_buffers->at(i);
+      CHECK_EQ(buf.dev_mask, kCPU) << "output buffer must be on cpu";
+      CHECK_EQ(buf.dtype, kFloat32) << "only float is supported so far";
+      CHECK_EQ(buf.shape.Size(), shape.Size())
+          << "size of output buffer " << i << " mismatch, expect shape " << shape;
+    }
+    BindOutputMemory(out_buffers);
+  }
+  // limit threads used by torch and native operators during the run.
+  ThreadLimitScope thread_limit(num_threads_);
+  TorchThreadsScope torch_threads(fset_torch_threads_, num_threads_);
+  try {
     // execution
-    const auto& idx = graph_.indexed_graph();
-    auto* th = TorchState::ThreadLocalState();
-    for (size_t i = 0; i < op_execs_.size(); ++i) {
-      // copy in place holder as demanded.
-      if (placeholder_tblobs_[i].data != nullptr) {
-        th->CopyFromTo(th->NewTensorShared(placeholder_tblobs_[i]),
-                       data_entry_[idx.entry_id(i, 0)]);
-      }
-      try {
-        // TODO op_execs_[i].nil()?
-        if (op_execs_[i]) {
-          op_execs_[i]();
-        }
-      } catch (dmlc::Error e) {
-        LOG(INFO) << "error catched in op " << idx[i].source->op()->name;
-        throw e;
-      }
+    ProfilePhase phase(profiler_, "RunOps");
+    if (parallel_) {
+      RunOpsParallel();
+    } else {
+      RunOps();
     }
+  } catch (...) {
+    if (out_buffers != nullptr) BindOutputMemory(nullptr);
+    throw;
   }
   {
     // copy outputs
+    ProfilePhase phase(profiler_, "CopyOutputs");
     output_blobs_.clear();
-    auto* th = TorchState::ThreadLocalState();
-    const auto& idx = graph_.indexed_graph();
     for (size_t i = 0; i < outputs_.size(); ++i) {
       uint32_t eid = idx.entry_id(idx.outputs()[i]);
-      th->CopyFromTo(data_entry_[eid], outputs_[i]);
-      output_blobs_.push_back(th->GetTBlob(outputs_[i]));
+      if (out_buffers == nullptr) {
+        CopyTraced(data_entry_[eid], outputs_[i], "output" + std::to_string(i), eid);
+        output_blobs_.push_back(th->GetTBlob(outputs_[i]));
+      } else {
+        TBlob out = out_buffers->at(i);
+        out.shape = node_shape_->at(eid);
+        // bound outputs are already written by the op.
+        if (output_bind_[i].is_nil()) {
+          CopyTraced(data_entry_[eid], th->NewTensorShared(out),
+                     "output" + std::to_string(i), eid);
+        }
+        output_blobs_.push_back(out);
+      }
     }
   }
+  if (out_buffers != nullptr) BindOutputMemory(nullptr);
   return output_blobs_;
 }
 
+void TorchExecutor::RunOps() {
+  auto* th = TorchState::ThreadLocalState();
+  size_t i = 0;
+  try {
+    for (; i < exec_plan_.size(); ++i) {
+      const ExecStep& step = exec_plan_[i];
+      if (step.copy_eid == kNoCopy) {
+        ExecOp(step.nid, step.exec);
+      } else if (placeholder_tblobs_[step.nid].data != nullptr) {
+        // copy in place holder as demanded.
+        CopyTraced(th->NewTensorShared(placeholder_tblobs_[step.nid]),
+                   data_entry_[step.copy_eid],
+                   graph_.indexed_graph()[step.nid].source->attrs.name,
+                   step.copy_eid);
+      }
+    }
+  } catch (dmlc::Error e) {
+    LOG(INFO) << "error catched in op "
+              << graph_.indexed_graph()[exec_plan_[i].nid].source->op()->name;
+    throw e;
+  }
+}
+
+void TorchExecutor::RunOpsParallel() {
+  const auto& idx = graph_.indexed_graph();
+  std::vector<uint32_t> ready;
+  sched_.remaining = 0;
+  sched_.error = nullptr;
+  sched_.lua_ready.clear();
+  sched_.native_ready.clear();
+  sched_.num_tasks = 0;
+  sched_.max_tasks = (num_threads_ > 1 ? static_cast<size_t>(num_threads_ - 1) : 0);
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    if (!op_execs_[nid] && !op_copy_[nid]) continue;
+    sched_.pending[nid].store(op_num_deps_[nid]);
+    ++sched_.remaining;
+    if (op_num_deps_[nid] == 0) ready.push_back(nid);
+  }
+  for (uint32_t nid : ready) {
+    ScheduleOp(nid);
+  }
+  while (true) {
+    uint32_t nid;
+    {
+      std::unique_lock<std::mutex> lock(sched_.mutex);
+      // the pool tasks still use the schedule state after the last node.
+      sched_.cv.wait(lock, [this]() {
+          return !sched_.lua_ready.empty() || !sched_.native_ready.empty() ||
+              (sched_.remaining == 0 && sched_.num_tasks == 0);
+        });
+      if (!sched_.lua_ready.empty()) {
+        nid = sched_.lua_ready.front();
+        sched_.lua_ready.pop_front();
+      } else if (!sched_.native_ready.empty()) {
+        nid = sched_.native_ready.front();
+        sched_.native_ready.pop_front();
+      } else {
+        break;
+      }
+    }
+    ExecScheduledOp(nid);
+  }
+  if (sched_.error != nullptr) {
+    std::rethrow_exception(sched_.error);
+  }
+}
+
+void TorchExecutor::ScheduleOp(uint32_t nid) {
+  {
+    std::lock_guard<std::mutex> lock(sched_.mutex);
+    if (!op_native_[nid]) {
+      sched_.lua_ready.push_back(nid);
+    } else if (sched_.max_tasks != 0 && sched_.num_tasks >= sched_.max_tasks) {
+      sched_.native_ready.push_back(nid);
+    } else {
+      ++sched_.num_tasks;
+      ThreadPool::Global()->Push([this, nid]() { this->RunPoolTask(nid); });
+      return;
+    }
+  }
+  sched_.cv.notify_all();
+}
+
+void TorchExecutor::RunPoolTask(uint32_t nid) {
+  ThreadLimitScope thread_limit(num_threads_);
+  while (true) {
+    ExecScheduledOp(nid);
+    std::lock_guard<std::mutex> lock(sched_.mutex);
+    if (sched_.native_ready.empty()) {
+      if (--sched_.num_tasks == 0 && sched_.remaining == 0) {
+        sched_.cv.notify_all();
+      }
+      return;
+    }
+    nid = sched_.native_ready.front();
+    sched_.native_ready.pop_front();
+  }
+}
+
+void TorchExecutor::ExecScheduledOp(uint32_t nid) {
+  bool failed;
+  {
+    std::lock_guard<std::mutex> lock(sched_.mutex);
+    failed = (sched_.error != nullptr);
+  }
+  // skip the remaining operators after an error.
+  if (!failed) {
+    try {
+      if (!op_copy_[nid]) {
+        ExecOp(nid, op_execs_[nid]);
+      } else if (placeholder_tblobs_[nid].data != nullptr) {
+        // copy in place holder as demanded, on the lua thread.
+        uint32_t eid = graph_.indexed_graph().entry_id(nid, 0);
+        CopyTraced(TorchState::ThreadLocalState()->NewTensorShared(placeholder_tblobs_[nid]),
+                   data_entry_[eid],
+                   graph_.indexed_graph()[nid].source->attrs.name, eid);
+      }
+    } catch (...) {
+      // any exception must reach the lua thread, not escape the pool worker.
+      LOG(INFO) << "error catched in op "
+                << graph_.indexed_graph()[nid].source->op()->name;
+      std::lock_guard<std::mutex> lock(sched_.mutex);
+      if (sched_.error == nullptr) sched_.error = std::current_exception();
+    }
+  }
+  for (uint32_t succ : op_successors_[nid]) {
+    if (sched_.pending[succ].fetch_sub(1) == 1) {
+      ScheduleOp(succ);
+    }
+  }
+  std::lock_guard<std::mutex> lock(sched_.mutex);
+  if (--sched_.remaining == 0) {
+    sched_.cv.notify_all();
+  }
+}
+
+ExecMemory TorchExecutor::GetMemory() const {
+  ExecMemory ret;
+  ret.in_arena = (arena_ != nullptr);
+  for (size_t size : pool_entry_size_) {
+    ret.storage_bytes.push_back(size * sizeof(float));
+    ret.pool_bytes += size * sizeof(float);
+  }
+  if (node_shape_ == nullptr) return ret;
+  const auto& idx = graph_.indexed_graph();
+  for (const auto& e : idx.outputs()) {
+    ret.output_bytes += node_shape_->at(idx.entry_id(e)).Size() * sizeof(float);
+  }
+  for (const auto& kv : cached_plans_) {
+    for (size_t size : kv.second->pool_entry_size) {
+      ret.cached_plan_bytes += size * sizeof(float);
+    }
+    const ShapeVector& shape = *(kv.second->node_shape);
+    const auto& cidx = kv.second->graph.indexed_graph();
+    for (const auto& e : cidx.outputs()) {
+      ret.cached_plan_bytes += shape.at(cidx.entry_id(e)).Size() * sizeof(float);
+    }
+  }
+  ret.num_cached_plans = cached_plans_.size();
+  if (!graph_.attrs.count("storage_id")) return ret;
+  // a storage is live from the first node writing it to the last node
+  // reading it, sweep the nodes in execution order.
+  const auto& vstorage = graph_.GetAttr<StorageVector>("storage_id");
+  const uint32_t kNone = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> first(pool_entry_size_.size(), kNone);
+  std::vector<uint32_t> last(pool_entry_size_.size(), 0);
+  auto touch = [&](uint32_t eid, uint32_t nid) {
+    if (vstorage[eid] < 0 || data_entry_is_var_[eid]) return;
+    size_t sid = static_cast<size_t>(vstorage[eid]);
+    if (sid >= pool_entry_size_.size()) return;
+    first[sid] = std::min(first[sid], nid);
+    last[sid] = std::max(last[sid], nid);
+  };
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    for (uint32_t i = 0; i < idx[nid].source->num_outputs(); ++i) {
+      touch(idx.entry_id(nid, i), nid);
+    }
+    for (const auto& e : idx[nid].inputs) {
+      touch(idx.entry_id(e), nid);
+    }
+  }
+  // outputs are read after the last node.
+  for (const auto& e : idx.outputs()) {
+    touch(idx.entry_id(e), idx.num_nodes());
+  }
+  std::vector<int64_t> delta(idx.num_nodes() + 2, 0);
+  for (size_t sid = 0; sid < pool_entry_size_.size(); ++sid) {
+    if (first[sid] == kNone) continue;
+    delta[first[sid]] += ret.storage_bytes[sid];
+    delta[last[sid] + 1] -= ret.storage_bytes[sid];
+  }
+  int64_t live = 0;
+  for (int64_t d : delta) {
+    live += d;
+    ret.planned_peak_bytes = std::max(ret.planned_peak_bytes, static_cast<size_t>(live));
+  }
+  return ret;
+}
+
+void TorchExecutor::Trace(const std::string& name, const std::string& cat,
+                          const std::vector<uint32_t>& eids,
+                          double begin, double end) {
+  std::ostringstream shape;
+  size_t bytes = 0;
+  for (size_t i = 0; i < eids.size(); ++i) {
+    const TShape& s = node_shape_->at(eids[i]);
+    if (i != 0) shape << ',';
+    shape << s;
+    bytes += s.Size() * sizeof(float);
+  }
+  profiler_->AddTrace(name, cat, begin, end, shape.str(), bytes);
+}
+
+void TorchExecutor::BindOutputMemory(const std::vector<TBlob>* buffers) {
+  const auto& idx = graph_.indexed_graph();
+  auto* th = TorchState::ThreadLocalState();
+  for (size_t i = 0; i < output_bind_.size(); ++i) {
+    if (output_bind_[i].is_nil()) continue;
+    uint32_t eid = idx.entry_id(idx.outputs()[i]);
+    void* dptr = (buffers != nullptr ? buffers->at(i).data : output_home_[i]);
+    th->RebindStorage(output_bind_[i], dptr, node_shape_->at(eid).Size());
+    data_blob_[eid].data = dptr;
+  }
+}
+
 void TorchExecutor::Setup(const std::unordered_map<std::string, TBlob>& inputs) {
   bool need_redo_infer;
   SetupShapeDType(inputs, &need_redo_infer);
@@ -323,19 +1735,55 @@ void TorchExecutor::Setup(const std::unordered_map<std::string, TBlob>& inputs)
     SetupShapeDType(inputs, &need_redo_infer);
   }
 #endif
-  if (need_redo_infer) SetupStorage();
+  if (need_redo_infer) {
+    ProfilePhase phase(profiler_, "SetupStorage");
+    SetupStorage();
+  }
   if (need_redo_infer) {
     op_execs_.clear();
     op_exec_modules_.clear();
     SetupOpExecs();
+    SetupExecPlan();
+    if (parallel_) SetupSchedule();
+  }
+  if (!ShapeDTypeMatch(inputs) && !SwitchBatchViews(PlanBatch(inputs))) {
+    // run a new batch size in the storage planned for max batch,
+    // closures are created for the new views, nn modules are kept.
+    InferShapeDType(inputs, 0);
+    SetupBatchViews();
+    op_execs_.clear();
+    SetupOpExecs();
+    SetupExecPlan();
+  }
+  BindArena();
+  {
+    // variables can be reallocated by executors of other threads.
+    const auto& idx = graph_.indexed_graph();
+    for (uint32_t nid : idx.input_nodes()) {
+      VarState* state = node_states_[nid];
+      if (!state->initialized()) continue;
+      uint32_t eid = idx.entry_id(nid, 0);
+      state->tensor(var_views_);
+      data_blob_[eid] = state->blob;
+    }
   }
   {
-    // copy inputs
+    // bind or copy inputs
     const auto& idx = graph_.indexed_graph();
+    auto* th = TorchState::ThreadLocalState();
     for (uint32_t nid : placeholder_nids_) {
       const std::string& key = idx[nid].source->attrs.name;
       const TBlob& value = inputs.at(key);
-      placeholder_tblobs_[nid] = value;
+      if (!placeholder_bind_[nid].is_nil()) {
+        uint32_t eid = idx.entry_id(nid, 0);
+        if (data_blob_[eid].data != value.data) {
+          th->RebindStorage(placeholder_bind_[nid], value.data, value.shape.Size());
+          data_blob_[eid].data = value.data;
+        }
+        placeholder_tblobs_[nid] = TBlob();
+      } else {
+        placeholder_tblobs_[nid] = value;
+      }
     }
   }
 }
@@ -343,43 +1791,55 @@ void TorchExecutor::Setup(const std::unordered_map<std::string, TBlob>& inputs)
 void TorchExecutor::SetupShapeDType(
     const std::unordered_map<std::string, TBlob>& inputs,
     bool* p_need_redo_infer) {
-  const auto& idx = graph_.indexed_graph();
   bool& need_redo_infer = *p_need_redo_infer;
-  need_redo_infer = (node_shape_ == nullptr);
+  need_redo_infer = !ShapeDTypeMatch(inputs);
+  if (!need_redo_infer) return;
+  uint32_t batch = PlanBatch(inputs);
+  if (batch != 0 && node_shape_ != nullptr &&
+      InputSignature(inputs) == plan_signature_) {
+    // only the batch size changes, the current plan can run it.
+    need_redo_infer = false;
+    return;
+  }
+  // the views of other batch sizes belong to the plan being replaced.
+  batch_views_.clear();
+  need_redo_infer = !SwitchPlan(inputs);
+  if (need_redo_infer) {
+    // plan for the max batch when the inputs fit in it.
+    InferShapeDType(inputs, batch != 0 ? max_batch_ : 0);
+  }
+}
 
+bool TorchExecutor::ShapeDTypeMatch(
+    const std::unordered_map<std::string, TBlob>& inputs) {
+  if (node_shape_ == nullptr) return false;
+  const auto& idx = graph_.indexed_graph();
   // check the variable states
-  if (!need_redo_infer) {
-    CHECK(node_dtype_ != nullptr);
-    for (uint32_t nid : read_var_nids_) {
-      VarState* state = node_states_[nid];
-      CHECK(state != nullptr);
-      CHECK(state->initialized())
-          << "Attempt to execute a graph un-initialized Variable";
-      if (node_shape_->at(idx.entry_id(nid, 0)) != state->blob.shape) {
-        need_redo_infer = true; break;
-      }
-      if (node_dtype_->at(idx.entry_id(nid, 0)) != state->blob.dtype) {
-        need_redo_infer = true; break;
-      }
-    }
+  CHECK(node_dtype_ != nullptr);
+  for (uint32_t nid : read_var_nids_) {
+    VarState* state = node_states_[nid];
+    CHECK(state != nullptr);
+    CHECK(state->initialized())
+        << "Attempt to execute a graph un-initialized Variable";
+    if (node_shape_->at(idx.entry_id(nid, 0)) != state->blob.shape) return false;
+    if (node_dtype_->at(idx.entry_id(nid, 0)) != state->blob.dtype) return false;
   }
   // check placeholder shapes.
-  if (!need_redo_infer) {
-    for (uint32_t nid : placeholder_nids_) {
-      const std::string& key = idx[nid].source->attrs.name;
-      CHECK(inputs.count(key))
-          << "Not enought placeholder argument to feed_dict";
-      const TBlob& value = inputs.at(key);
-      if (node_shape_->at(idx.entry_id(nid, 0)) != value.shape) {
-        need_redo_infer = true; break;
-      }
-      if (node_dtype_->at(idx.entry_id(nid, 0)) != value.dtype) {
-        need_redo_infer = true; break;
-      }
-    }
+  for (uint32_t nid : placeholder_nids_) {
+    const std::string& key = idx[nid].source->attrs.name;
+    CHECK(inputs.count(key))
+        << "Not enought placeholder argument to feed_dict";
+    const TBlob& value = inputs.at(key);
+    if (node_shape_->at(idx.entry_id(nid, 0)) != value.shape) return false;
+    if (node_dtype_->at(idx.entry_id(nid, 0)) != value.dtype) return false;
   }
+  return true;
+}
 
-  if (!need_redo_infer) return;
+void TorchExecutor::InferShapeDType(
+    const std::unordered_map<std::string, TBlob>& inputs, uint32_t batch) {
+  ProfilePhase phase(profiler_, "InferShape");
+  const auto& idx = graph_.indexed_graph();
   // run shape inference.
   ShapeVector new_shape(idx.num_node_entries(), TShape());
   DTypeVector new_dtype(idx.num_node_entries(), -1);
@@ -399,7 +1859,9 @@ void TorchExecutor::SetupShapeDType(
   for (uint32_t nid : placeholder_nids_) {
     const std::string& key = idx[nid].source->attrs.name;
     const TBlob& value = inputs.at(key);
-    new_shape[idx.entry_id(nid, 0)] = value.shape;
+    TShape shape = value.shape;
+    if (batch != 0) shape[0] = batch;
+    new_shape[idx.entry_id(nid, 0)] = shape;
     new_dtype[idx.entry_id(nid, 0)] = value.dtype;
   }
   graph_.attrs["shape"] = std::make_shared<any>(std::move(new_shape));
@@ -415,14 +1877,244 @@ void TorchExecutor::SetupShapeDType(
   for (uint32_t nid : assign_var_nids_) {
     node_states_[nid]->ResetSpace(
         node_shape_->at(idx.entry_id(nid, 0)),
+        var_views_,
         dev_mask_,
         node_dtype_->at(idx.entry_id(nid, 0)));
   }
 }
 
+uint32_t TorchExecutor::PlanBatch(
+    const std::unordered_map<std::string, TBlob>& inputs) {
+  if (max_batch_ == 0 || placeholder_nids_.size() == 0) return 0;
+  const auto& idx = graph_.indexed_graph();
+  uint32_t batch = 0;
+  for (uint32_t nid : placeholder_nids_) {
+    const TShape& shape = inputs.at(idx[nid].source->attrs.name).shape;
+    if (shape.ndim() == 0) return 0;
+    if (batch != 0 && shape[0] != batch) return 0;
+    batch = static_cast<uint32_t>(shape[0]);
+  }
+  return batch <= max_batch_ ? batch : 0;
+}
+
+void TorchExecutor::BindArena() {
+  if (arena_ == nullptr) return;
+  char* base = static_cast<char*>(arena_->Reserve(arena_bytes_));
+  if (base == arena_base_) return;
+  arena_base_ = base;
+  const auto& idx = graph_.indexed_graph();
+  const auto& vstorage = graph_.GetAttr<StorageVector>("storage_id");
+  auto* th = TorchState::ThreadLocalState();
+  for (size_t sid = 0; sid < storage_pool_.size(); ++sid) {
+    th->RebindStorage(storage_pool_[sid], base + pool_offset_[sid],
+                      pool_entry_size_[sid]);
+  }
+  std::vector<bool> entry_bound(idx.num_node_entries(), false);
+  for (uint32_t nid : placeholder_nids_) {
+    if (!placeholder_bind_[nid].is_nil()) entry_bound[idx.entry_id(nid, 0)] = true;
+  }
+  for (size_t i = 0; i < output_bind_.size(); ++i) {
+    if (output_bind_[i].is_nil()) continue;
+    uint32_t eid = idx.entry_id(idx.outputs()[i]);
+    output_home_[i] = base + pool_offset_[vstorage[eid]];
+    th->RebindStorage(output_bind_[i], output_home_[i], node_shape_->at(eid).Size());
+    data_blob_[eid].data = output_home_[i];
+    entry_bound[eid] = true;
+  }
+  for (size_t i = 0; i < data_blob_.size(); ++i) {
+    if (data_entry_is_var_[i] || entry_bound[i]) continue;
+    data_blob_[i].data = base + pool_offset_[vstorage[i]];
+  }
+}
+
+void TorchExecutor::SetupBatchViews() {
+  const auto& idx = graph_.indexed_graph();
+  const auto& vstorage = graph_.GetAttr<StorageVector>("storage_id");
+  auto* th = TorchState::ThreadLocalState();
+  // storage each entry is bound to, other than the pool.
+  std::vector<LuaRef> bound(idx.num_node_entries());
+  for (uint32_t nid : placeholder_nids_) {
+    bound[idx.entry_id(nid, 0)] = placeholder_bind_[nid];
+  }
+  for (size_t i = 0; i < output_bind_.size(); ++i) {
+    if (output_bind_[i].is_nil()) continue;
+    bound[idx.entry_id(idx.outputs()[i])] = output_bind_[i];
+  }
+  for (size_t i = 0; i < data_entry_.size(); ++i) {
+    if (data_entry_is_var_[i]) continue;
+    const TShape& shape = node_shape_->at(i);
+    if (!bound[i].is_nil()) {
+      th->ResetStorage(data_entry_[i], bound[i], shape);
+    } else {
+      size_t sid = static_cast<size_t>(vstorage[i]);
+      CHECK_LE(shape.Size(), pool_entry_size_[sid])
+          << "batch does not fit in the storage planned for max_batch";
+      th->ResetStorage(data_entry_[i], storage_pool_[sid], shape);
+    }
+    data_blob_[i] = th->GetTBlob(data_entry_[i]);
+  }
+  for (uint32_t nid : placeholder_nids_) {
+    // force the fed memory to be rebound with the new size.
+    if (!placeholder_bind_[nid].is_nil()) {
+      data_blob_[idx.entry_id(nid, 0)].data = nullptr;
+    }
+  }
+  for (size_t i = 0; i < outputs_.size(); ++i) {
+    uint32_t eid = idx.entry_id(idx.outputs()[i]);
+    th->ResetStorage(outputs_[i], output_storage_[i], node_shape_->at(eid));
+  }
+}
+
+uint32_t TorchExecutor::ViewBatch() const {
+  const auto& idx = graph_.indexed_graph();
+  return static_cast<uint32_t>(
+      node_shape_->at(idx.entry_id(placeholder_nids_.at(0), 0))[0]);
+}
+
+bool TorchExecutor::SwitchBatchViews(uint32_t batch) {
+  CHECK_NE(batch, 0U);
+  uint32_t current = ViewBatch();
+  std::unique_ptr<BatchViews> views(new BatchViews());
+  SwapBatchViews(views.get());
+  views->last_used = ++plan_clock_;
+  auto it = batch_views_.find(batch);
+  if (it != batch_views_.end()) {
+    SwapBatchViews(it->second.get());
+    batch_views_.erase(it);
+    batch_views_[current] = std::move(views);
+    const auto& idx = graph_.indexed_graph();
+    // rebind the arena and the fed memory, they may have moved since.
+    arena_base_ = nullptr;
+    for (uint32_t nid : placeholder_nids_) {
+      if (!placeholder_bind_[nid].is_nil()) {
+        data_blob_[idx.entry_id(nid, 0)].data = nullptr;
+      }
+    }
+    return true;
+  }
+  // new views start from the current ones, with their own tensors.
+  auto* th = TorchState::ThreadLocalState();
+  data_entry_.resize(views->data_entry.size());
+  for (size_t i = 0; i < data_entry_.size(); ++i) {
+    data_entry_[i] = (data_entry_is_var_[i] ?
+                      views->data_entry[i] : th->NewTensorEmpty(dev_mask_));
+  }
+  data_blob_ = views->data_blob;
+  outputs_.resize(views->outputs.size());
+  for (size_t i = 0; i < outputs_.size(); ++i) {
+    outputs_[i] = th->NewTensorEmpty(dev_mask_);
+  }
+  batch_views_[current] = std::move(views);
+  while (batch_views_.size() > plan_cache_size_) {
+    auto victim = batch_views_.begin();
+    for (auto jt = batch_views_.begin(); jt != batch_views_.end(); ++jt) {
+      if (jt->second->last_used < victim->second->last_used) victim = jt;
+    }
+    batch_views_.erase(victim);
+  }
+  return false;
+}
+
+void TorchExecutor::SwapBatchViews(BatchViews* views) {
+  // empty views take the shapes, and leave the current ones in the graph.
+  std::shared_ptr<any> shape = views->shape;
+  views->shape = graph_.attrs.at("shape");
+  if (shape != nullptr) {
+    graph_.attrs["shape"] = shape;
+    node_shape_ = &(graph_.GetAttr<ShapeVector>("shape"));
+  }
+  // closures point into data_blob_, which moves along with them.
+  std::swap(data_entry_, views->data_entry);
+  std::swap(data_blob_, views->data_blob);
+  std::swap(op_execs_, views->op_execs);
+  std::swap(exec_plan_, views->exec_plan);
+  std::swap(outputs_, views->outputs);
+}
+
+std::string TorchExecutor::InputSignature(
+    const std::unordered_map<std::string, TBlob>& inputs) {
+  const auto& idx = graph_.indexed_graph();
+  // inputs that fit in max batch share the plan of max batch.
+  bool max_batch = PlanBatch(inputs) != 0;
+  std::ostringstream os;
+  for (uint32_t nid : read_var_nids_) {
+    const TBlob& blob = node_states_[nid]->blob;
+    os << blob.shape << blob.dtype << ';';
+  }
+  for (uint32_t nid : placeholder_nids_) {
+    const TBlob& value = inputs.at(idx[nid].source->attrs.name);
+    TShape shape = value.shape;
+    if (max_batch) shape[0] = max_batch_;
+    os << shape << value.dtype << ';';
+  }
+  return os.str();
+}
+
+bool TorchExecutor::SwitchPlan(
+    const std::unordered_map<std::string, TBlob>& inputs) {
+  std::string signature = InputSignature(inputs);
+  if (plan_cache_size_ <= 1) {
+    plan_signature_ = signature;
+    return false;
+  }
+  if (node_shape_ != nullptr) {
+    // keep the current plan, start from an empty one with the same graph.
+    std::unique_ptr<CachedPlan> plan(new CachedPlan());
+    plan->graph = graph_;
+    SwapPlan(plan.get());
+    plan->last_used = ++plan_clock_;
+    cached_plans_[plan_signature_] = std::move(plan);
+  }
+  plan_signature_ = signature;
+  auto it = cached_plans_.find(signature);
+  if (it != cached_plans_.end()) {
+    SwapPlan(it->second.get());
+    cached_plans_.erase(it);
+    return true;
+  }
+  while (cached_plans_.size() >= plan_cache_size_) {
+    auto victim = cached_plans_.begin();
+    for (auto jt = cached_plans_.begin(); jt != cached_plans_.end(); ++jt) {
+      if (jt->second->last_used < victim->second->last_used) victim = jt;
+    }
+    TorchState::ThreadLocalState()->ReleaseStorage(&victim->second->storage_pool);
+    cached_plans_.erase(victim);
+  }
+  return false;
+}
+
+void TorchExecutor::SwapPlan(CachedPlan* plan) {
+  std::swap(graph_, plan->graph);
+  std::swap(node_shape_, plan->node_shape);
+  std::swap(node_dtype_, plan->node_dtype);
+  std::swap(data_entry_, plan->data_entry);
+  std::swap(data_entry_is_var_, plan->data_entry_is_var);
+  std::swap(data_blob_, plan->data_blob);
+  std::swap(storage_pool_, plan->storage_pool);
+  std::swap(pool_entry_size_, plan->pool_entry_size);
+  std::swap(pool_offset_, plan->pool_offset);
+  std::swap(arena_bytes_, plan->arena_bytes);
+  std::swap(placeholder_bind_, plan->placeholder_bind);
+  std::swap(op_execs_, plan->op_execs);
+  std::swap(op_exec_modules_, plan->op_exec_modules);
+  std::swap(op_native_, plan->op_native);
+  std::swap(exec_plan_, plan->exec_plan);
+  std::swap(op_successors_, plan->op_successors);
+  std::swap(op_num_deps_, plan->op_num_deps);
+  std::swap(op_copy_, plan->op_copy);
+  std::swap(sched_.pending, plan->pending);
+  std::swap(output_bind_, plan->output_bind);
+  std::swap(output_home_, plan->output_home);
+  std::swap(outputs_, plan->outputs);
+  std::swap(output_storage_, plan->output_storage);
+  // the other plan may have been bound to another arena memory.
+  arena_base_ = nullptr;
+}
+
 void TorchExecutor::SetupStorage() {
   const auto& idx = graph_.indexed_graph();
   if (storage_pool_.size() == 0) {
+    ProfilePhase phase(profiler_, "PlanMemory");
     graph_ = nnvm::ApplyPass(std::move(graph_), "PlanMemory");
   }
   const auto& vstorage = graph_.GetAttr<StorageVector>("storage_id");
@@ -437,42 +2129,120 @@ void TorchExecutor::SetupStorage() {
     }
     for (uint32_t nid : idx.input_nodes()) {
       CHECK(node_states_[nid] != nullptr);
-      data_entry_[idx.entry_id(nid, 0)] = node_states_[nid]->tensor;
+      data_entry_[idx.entry_id(nid, 0)] = node_states_[nid]->tensor(var_views_);
       data_entry_is_var_[idx.entry_id(nid, 0)] = true;
     }
   }
 
+  // A placeholder can use the fed memory without copy when no other entry
+  // shares its planned storage and no op writes into it.
+  std::vector<int> sid_count;
+  for (size_t i = 0; i < vstorage.size(); ++i) {
+    if (data_entry_is_var_[i] || vstorage[i] < 0) continue;
+    size_t sid = static_cast<size_t>(vstorage[i]);
+    if (sid >= sid_count.size()) sid_count.resize(sid + 1, 0);
+    ++sid_count[sid];
+  }
+  const auto& fmutate_inputs =
+      nnvm::Op::GetAttr<nnvm::FMutateInputs>("FMutateInputs");
+  std::vector<bool> entry_mutated(idx.num_node_entries(), false);
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    const auto& inode = idx[nid];
+    if (inode.source->is_variable() ||
+        !fmutate_inputs.count(inode.source->op())) continue;
+    for (uint32_t i : fmutate_inputs[inode.source->op()](inode.source->attrs)) {
+      entry_mutated[idx.entry_id(inode.inputs[i])] = true;
+    }
+  }
+  std::vector<bool> entry_bound(idx.num_node_entries(), false);
+  placeholder_bind_.clear();
+  placeholder_bind_.resize(idx.num_nodes());
+  if (dev_mask_ == kCPU) {
+    for (uint32_t nid : placeholder_nids_) {
+      uint32_t eid = idx.entry_id(nid, 0);
+      if (vstorage[eid] < 0 || sid_count[vstorage[eid]] != 1 ||
+          entry_mutated[eid]) continue;
+      placeholder_bind_[nid] = th->NewStorageShared(nullptr, vshape[eid].Size());
+      entry_bound[eid] = true;
+    }
+  }
 
   // size of each storage pool entry
-  std::vector<size_t> pool_entry_size;
+  pool_entry_size_.clear();
   for (size_t i = 0; i < vshape.size(); ++i) {
-    if (data_entry_is_var_[i]) continue;
+    if (data_entry_is_var_[i] || entry_bound[i]) continue;
     int storage_id = vstorage[i];
     size_t size = vshape[i].Size();
     CHECK_GE(storage_id, 0) << "Do not support runtime shape op yet";
     size_t sid = static_cast<size_t>(storage_id);
-    if (sid >= pool_entry_size.size()) {
-      pool_entry_size.resize(sid + 1, 0);
+    if (sid >= pool_entry_size_.size()) {
+      pool_entry_size_.resize(sid + 1, 0);
     }
-    pool_entry_size[sid] = std::max(pool_entry_size[sid], size);
+    pool_entry_size_[sid] = std::max(pool_entry_size_[sid], size);
   }
-  storage_pool_.clear();
-  for (size_t i = 0; i < pool_entry_size.size(); ++i) {
-    storage_pool_.push_back(
-        th->NewStorage(pool_entry_size[i], dev_mask_));
+  // the old pool goes back to the storage arena right away.
+  th->ReleaseStorage(&storage_pool_);
+  if (arena_ != nullptr) {
+    // the pool wraps aligned blocks of the arena, bound by BindArena.
+    pool_offset_.resize(pool_entry_size_.size());
+    arena_bytes_ = 0;
+    for (size_t i = 0; i < pool_entry_size_.size(); ++i) {
+      pool_offset_[i] = arena_bytes_;
+      size_t bytes = pool_entry_size_[i] * sizeof(float);
+      arena_bytes_ += (bytes + ActivationArena::kAlign - 1) /
+          ActivationArena::kAlign * ActivationArena::kAlign;
+      storage_pool_.push_back(th->NewStorageShared(nullptr, pool_entry_size_[i]));
+    }
+    arena_base_ = nullptr;
+  } else {
+    for (size_t i = 0; i < pool_entry_size_.size(); ++i) {
+      storage_pool_.push_back(
+          th->NewStorage(pool_entry_size_[i], dev_mask_));
+    }
   }
   // assign pooled data to entry
   for (size_t i = 0; i < data_entry_.size(); ++i) {
-    if (data_entry_is_var_[i]) continue;
+    if (data_entry_is_var_[i] || entry_bound[i]) continue;
     int storage_id = vstorage[i];
     th->ResetStorage(data_entry_[i], storage_pool_.at(storage_id), vshape[i]);
   }
+  for (uint32_t nid : placeholder_nids_) {
+    if (placeholder_bind_[nid].is_nil()) continue;
+    uint32_t eid = idx.entry_id(nid, 0);
+    th->ResetStorage(data_entry_[eid], placeholder_bind_[nid], vshape[eid]);
+  }
+  // outputs that own their planned storage can be written
+  // directly into caller provided buffers.
+  output_bind_.clear();
+  output_bind_.resize(idx.outputs().size());
+  output_home_.assign(idx.outputs().size(), nullptr);
+  if (dev_mask_ == kCPU) {
+    std::vector<int> out_count(idx.num_node_entries(), 0);
+    for (const auto& e : idx.outputs()) {
+      ++out_count[idx.entry_id(e)];
+    }
+    for (size_t i = 0; i < idx.outputs().size(); ++i) {
+      uint32_t eid = idx.entry_id(idx.outputs()[i]);
+      if (data_entry_is_var_[eid] || entry_bound[eid] || vstorage[eid] < 0 ||
+          sid_count[vstorage[eid]] != 1 || entry_mutated[eid] ||
+          out_count[eid] != 1) continue;
+      output_home_[i] = th->GetTBlob(data_entry_[eid]).data;
+      output_bind_[i] = th->NewStorageShared(output_home_[i], vshape[eid].Size());
+      th->ResetStorage(data_entry_[eid], output_bind_[i], vshape[eid]);
+    }
+  }
+  data_blob_.resize(data_entry_.size());
+  for (size_t i = 0; i < data_entry_.size(); ++i) {
+    data_blob_[i] = th->GetTBlob(data_entry_[i]);
+  }
 
   outputs_.resize(idx.outputs().size());
+  output_storage_.resize(idx.outputs().size());
   for (size_t i = 0; i < outputs_.size(); ++i) {
     uint32_t eid = idx.entry_id(idx.outputs()[i]);
     LuaRef t = th->NewTensorEmpty(kCPU);
-    th->ResetStorage(t, th->NewStorage(vshape[eid].Size(), kCPU), vshape[eid]);
+    output_storage_[i] = th->NewStorage(vshape[eid].Size(), kCPU);
+    th->ResetStorage(t, output_storage_[i], vshape[eid]);
     outputs_[i] = t;
   }
 }
@@ -480,23 +2250,21 @@ void TorchExecutor::SetupStorage() {
 void TorchExecutor::SetupOpExecs() {
   // a slightly big function to setup execution functors
   // We can separate some logics into a new pass later.
-  auto* lua = LuaState::ThreadLocalState();
+  // The lua functions are compiled once per thread and cached in TorchState,
+  // a rebuild only instantiates the closures.
+  ProfilePhase phase(profiler_, "SetupOpExecs");
+  auto* th = TorchState::ThreadLocalState();
   const auto& idx = graph_.indexed_graph();
   const auto& lua_create_module =
       nnvm::Op::GetAttr<FLuaCreateNNModule>("FLuaCreateNNModule");
   const auto& lua_compute_code =
       nnvm::Op::GetAttr<FLuaCompute>("FLuaCompute");
-  LuaRef lempty_tensor = lua->Eval(R"(
-    return
-    function(dev_mask)
-      local empty = torch.FloatTensor()
-      if dev_mask == 2 then
-        empty = empty:cuda()
-      end
-      return empty
-    end
-   )")(dev_mask_);
-  LuaRef fremove_module_storage = lua->Eval(R"(
+  const auto& native_compute =
+      nnvm::Op::GetAttr<FCompute>("FCompute");
+  const auto& no_compute =
+      nnvm::Op::GetAttr<TNoCompute>("TNoCompute");
+  LuaRef lempty_tensor = th->NewTensorEmpty(dev_mask_);
+  const LuaRef& fremove_module_storage = th->GetFunction("remove_module_storage", R"(
     return
     function(m, dev_mask, empty)
       if dev_mask == 2 then
@@ -521,7 +2289,7 @@ void TorchExecutor::SetupOpExecs() {
       return m
     end
   )");
-  LuaRef fcreate_nnforward_closure = lua->Eval(R"(
+  const LuaRef& fcreate_nnforward_closure = th->GetFunction("create_nnforward_closure", R"(
     return
     function(m, input, output, weight)
       if torch.isTypeOf(m, nn.Module) then
@@ -558,7 +2326,7 @@ void TorchExecutor::SetupOpExecs() {
       end
     end
   )");
-  LuaRef fcreate_nnbackward_closure = lua->Eval(R"(
+  const LuaRef& fcreate_nnbackward_closure = th->GetFunction("create_nnbackward_closure", R"(
     return
     function(m, input, output, weight, gradInput, gradOutput, gradWeight)
       if torch.isTypeOf(m, nn.Module) then
@@ -619,10 +2387,9 @@ void TorchExecutor::SetupOpExecs() {
   for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
     const auto& inode = idx[nid];
     if (inode.source->is_variable()) continue;
-    std::string lua_code;
-    if (lua_create_module.count(inode.source->op())) {
-      lua_code = "return " + lua_create_module[inode.source->op()];
-      LuaRef fcreate = lua->Eval(lua_code);
+    if (lua_create_module.count(inode.source->op()) &&
+        op_exec_modules_[nid].is_nil()) {
+      const LuaRef& fcreate = th->GetLuaCreateNNModule(inode.source->op());
       std::vector<TShape> ishape;
       for (auto& e : inode.inputs) {
         ishape.push_back(node_shape_->at(idx.entry_id(e)));
@@ -635,10 +2402,12 @@ void TorchExecutor::SetupOpExecs() {
   // setup executor closure
   const Op* backward_op = Op::Get("_backward");
   op_execs_.resize(idx.num_nodes());
+  op_native_.assign(idx.num_nodes(), false);
   // setup the array and requirements.
   for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
     const auto& inode = idx[nid];
     if (inode.source->is_variable()) continue;
+    if (no_compute.get(inode.source->op(), false)) continue;
     std::vector<LuaRef> in_array, out_array;
     for (const auto& e : inode.inputs) {
       in_array.push_back(data_entry_[idx.entry_id(e)]);
@@ -652,13 +2421,24 @@ void TorchExecutor::SetupOpExecs() {
     if (node_rtc_ && node_rtc_->count(nid)) {
       // rtc compute
       op_execs_[nid] = GenerateRTCClosure(node_rtc_->at(nid), in_array, out_array);
-    } else if (lua_compute_code.count(inode.source->op())) {
+    } else if (dev_mask_ == kCPU && native_compute.count(inode.source->op())) {
 #else
-    if (lua_compute_code.count(inode.source->op())) {
+    if (dev_mask_ == kCPU && native_compute.count(inode.source->op())) {
 #endif
+      // native compute function, runs on raw TBlob without lua.
+      std::vector<const TBlob*> in_blob, out_blob;
+      for (const auto& e : inode.inputs) {
+        in_blob.push_back(&data_blob_[idx.entry_id(e)]);
+      }
+      for (uint32_t index = 0; index < inode.source->num_outputs(); ++index) {
+        out_blob.push_back(&data_blob_[idx.entry_id(nid, index)]);
+      }
+      op_execs_[nid] = native_compute[inode.source->op()](
+          inode.source->attrs, in_blob, out_blob);
+      op_native_[nid] = true;
+    } else if (lua_compute_code.count(inode.source->op())) {
       // compute function
-      std::string lua_str = "return " + lua_compute_code[inode.source->op()];
-      LuaRef fcompute = lua->Eval(lua_str);
+      const LuaRef& fcompute = th->GetLuaCompute(inode.source->op());
       op_execs_[nid] = fcompute(
           in_array, out_array, inode.source->attrs.dict);
     } else if (!op_exec_modules_[nid].is_nil()) {
@@ -707,6 +2487,102 @@ void TorchExecutor::SetupOpExecs() {
   }
 }
 
+void TorchExecutor::SetupExecPlan() {
+  const Op* placeholder_op = Op::Get("placeholder");
+  const auto& idx = graph_.indexed_graph();
+  exec_plan_.clear();
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    if (idx[nid].source->is_variable()) continue;
+    if (idx[nid].source->op() == placeholder_op) {
+      // bound placeholders never need a copy.
+      if (placeholder_bind_[nid].is_nil()) {
+        exec_plan_.push_back(ExecStep{nid, idx.entry_id(nid, 0), FOpExec()});
+      }
+    }
+    if (op_execs_[nid]) {
+      exec_plan_.push_back(ExecStep{nid, kNoCopy, op_execs_[nid]});
+    }
+  }
+}
+
+void TorchExecutor::SetupSchedule() {
+  // Besides the data flow, parallel execution must respect the reuse of
+  // memory decided by PlanMemory, so dependencies are derived from the
+  // reads and writes of each memory in the sequential order.
+  // Placeholders that are copied in write their memory as a step of their own.
+  const auto& idx = graph_.indexed_graph();
+  op_copy_.assign(idx.num_nodes(), false);
+  for (uint32_t nid : placeholder_nids_) {
+    op_copy_[nid] = placeholder_bind_[nid].is_nil();
+  }
+  auto scheduled = [this](uint32_t nid) {
+    return static_cast<bool>(op_execs_[nid]) || op_copy_[nid];
+  };
+  const auto& vstorage = graph_.GetAttr<StorageVector>("storage_id");
+  const auto& fmutate_inputs =
+      nnvm::Op::GetAttr<nnvm::FMutateInputs>("FMutateInputs");
+  // key of memory used by entry, variables are keyed after the pool.
+  auto memory_key = [this, &vstorage](uint32_t eid) {
+    if (data_entry_is_var_[eid]) return storage_pool_.size() + eid;
+    return static_cast<size_t>(vstorage[eid]);
+  };
+  size_t num_keys = storage_pool_.size() + idx.num_node_entries();
+  std::vector<int> last_writer(num_keys, -1);
+  std::vector<std::vector<uint32_t> > readers(num_keys);
+  std::vector<std::vector<uint32_t> > deps(idx.num_nodes());
+
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    const auto& inode = idx[nid];
+    if (!scheduled(nid)) continue;
+    std::vector<uint32_t>& dep = deps[nid];
+    for (uint32_t cid : inode.control_deps) {
+      if (scheduled(cid)) dep.push_back(cid);
+    }
+    std::vector<size_t> rkeys, wkeys;
+    for (const auto& e : inode.inputs) {
+      rkeys.push_back(memory_key(idx.entry_id(e)));
+    }
+    for (uint32_t index = 0; index < inode.source->num_outputs(); ++index) {
+      wkeys.push_back(memory_key(idx.entry_id(nid, index)));
+    }
+    if (fmutate_inputs.count(inode.source->op())) {
+      for (uint32_t i : fmutate_inputs[inode.source->op()](inode.source->attrs)) {
+        wkeys.push_back(memory_key(idx.entry_id(inode.inputs[i])));
+      }
+    }
+    // read after write
+    for (size_t k : rkeys) {
+      if (last_writer[k] >= 0) dep.push_back(last_writer[k]);
+    }
+    // write after write, write after read
+    for (size_t k : wkeys) {
+      if (last_writer[k] >= 0) dep.push_back(last_writer[k]);
+      dep.insert(dep.end(), readers[k].begin(), readers[k].end());
+    }
+    for (size_t k : rkeys) {
+      readers[k].push_back(nid);
+    }
+    for (size_t k : wkeys) {
+      last_writer[k] = static_cast<int>(nid);
+      readers[k].clear();
+    }
+  }
+
+  op_successors_.assign(idx.num_nodes(), std::vector<uint32_t>());
+  op_num_deps_.assign(idx.num_nodes(), 0);
+  for (uint32_t nid = 0; nid < idx.num_nodes(); ++nid) {
+    std::vector<uint32_t>& dep = deps[nid];
+    std::sort(dep.begin(), dep.end());
+    dep.erase(std::unique(dep.begin(), dep.end()), dep.end());
+    for (uint32_t d : dep) {
+      if (d == nid) continue;
+      op_successors_[d].push_back(nid);
+      ++op_num_deps_[nid];
+    }
+  }
+  sched_.pending.reset(new std::atomic<uint32_t>[idx.num_nodes()]);
+}
+
 #if TINYFLOW_USE_FUSION == 1
 FOpExec TorchExecutor::GenerateRTCClosure(RTC& rtc,
     const std::vector<LuaRef>& input_luaref, std::vector<LuaRef>& output_luaref) {
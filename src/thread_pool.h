@@ -0,0 +1,268 @@
+/*!
+ *  Copyright (c) 2016 by Contributors
+ * \file thread_pool.h
+ * \brief process wide work stealing pool and parallel loop primitives.
+ */
+#ifndef TINYFLOW_THREAD_POOL_H_
+#define TINYFLOW_THREAD_POOL_H_
+
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tinyflow {
+
+/*!
+ * \brief pool of worker threads with work stealing.
+ *  Each worker owns a queue, a worker pushes tasks to its own queue
+ *  and takes the latest one first, idle workers steal the oldest
+ *  tasks from other queues. Pushing and taking tasks only lock the
+ *  queue involved, the pool lock is only taken to sleep when no queue
+ *  has a task, and to wake the sleeping workers.
+ *  Tasks must not touch the lua state, which is thread local.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t num_workers) {
+    for (size_t i = 0; i < num_workers; ++i) {
+      queues_.emplace_back(new WorkQueue());
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers_.emplace_back([this, i]() { this->WorkerLoop(i); });
+    }
+  }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& t : workers_) t.join();
+  }
+  // push a task to be run by the workers.
+  void Push(std::function<void()> task) {
+    CHECK_NE(queues_.size(), 0U);
+    size_t qid;
+    if (CurrentPool() == this) {
+      qid = CurrentWorker();
+    } else {
+      qid = next_queue_.fetch_add(1) % queues_.size();
+    }
+    {
+      std::lock_guard<std::mutex> qlock(queues_[qid]->mutex);
+      queues_[qid]->tasks.push_back(std::move(task));
+    }
+    // a worker going to sleep either sees the task or is counted here.
+    num_queued_.fetch_add(1);
+    if (num_sleeping_.load() != 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+  // number of worker threads.
+  size_t num_workers() const {
+    return workers_.size();
+  }
+  /*!
+   * \brief process wide pool, one worker less than the hardware threads,
+   *  as the thread starting a parallel loop takes part in it.
+   *  The number of workers can be overriden by environment variable
+   *  TINYFLOW_NUM_THREADS.
+   */
+  static ThreadPool* Global() {
+    static ThreadPool inst(static_cast<size_t>(std::max(
+        dmlc::GetEnv("TINYFLOW_NUM_THREADS",
+                     static_cast<int>(std::thread::hardware_concurrency()) - 1), 1)));
+    return &inst;
+  }
+  /*!
+   * \brief maximum number of threads used by parallel loops
+   *  started from the current thread, 0 means no limit.
+   */
+  static int& ThreadLimit() {
+    static thread_local int limit = 0;
+    return limit;
+  }
+
+ private:
+  struct WorkQueue {
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+  };
+  static ThreadPool*& CurrentPool() {
+    static thread_local ThreadPool* pool = nullptr;
+    return pool;
+  }
+  static size_t& CurrentWorker() {
+    static thread_local size_t wid = 0;
+    return wid;
+  }
+  // take a task from own queue, or steal from others.
+  bool TryPop(size_t wid, std::function<void()>* task) {
+    {
+      WorkQueue* q = queues_[wid].get();
+      std::lock_guard<std::mutex> lock(q->mutex);
+      if (!q->tasks.empty()) {
+        *task = std::move(q->tasks.back());
+        q->tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      WorkQueue* q = queues_[(wid + i) % queues_.size()].get();
+      std::lock_guard<std::mutex> lock(q->mutex);
+      if (!q->tasks.empty()) {
+        *task = std::move(q->tasks.front());
+        q->tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+  void WorkerLoop(size_t wid) {
+    CurrentPool() = this;
+    CurrentWorker() = wid;
+    std::function<void()> task;
+    while (true) {
+      if (TryPop(wid, &task)) {
+        num_queued_.fetch_sub(1);
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      // counted before checking the queues, so a push after the check wakes it.
+      num_sleeping_.fetch_add(1);
+      cv_.wait(lock, [this]() { return stop_ || num_queued_.load() != 0; });
+      num_sleeping_.fetch_sub(1);
+      // the tasks pushed before stop are still carried out.
+      if (stop_ && num_queued_.load() == 0) return;
+    }
+  }
+  std::vector<std::unique_ptr<WorkQueue> > queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_queue_{0};
+  // number of tasks in the queues.
+  std::atomic<size_t> num_queued_{0};
+  // number of workers sleeping or going to sleep on cv_.
+  std::atomic<size_t> num_sleeping_{0};
+  // taken to sleep and to wake the sleeping workers.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+};
+
+/*! \brief set the thread limit of the current thread within a scope. */
+class ThreadLimitScope {
+ public:
+  explicit ThreadLimitScope(int limit)
+      : prev_(ThreadPool::ThreadLimit()) {
+    ThreadPool::ThreadLimit() = limit;
+  }
+  ~ThreadLimitScope() {
+    ThreadPool::ThreadLimit() = prev_;
+  }
+
+ private:
+  int prev_;
+};
+
+/*!
+ * \brief run fchunk(begin, end) over chunks of [begin, end) in parallel.
+ *  The calling thread takes part in the work, so it is safe to call
+ *  from tasks running in the pool.
+ * \param begin begin of the range.
+ * \param end end of the range.
+ * \param grain minimum size of each chunk.
+ * \param fchunk function to process a chunk, called with chunk_begin, chunk_end.
+ */
+inline void ParallelFor(size_t begin, size_t end, size_t grain,
+                        const std::function<void(size_t, size_t)>& fchunk) {
+  if (end <= begin) return;
+  ThreadPool* pool = ThreadPool::Global();
+  size_t nthread = pool->num_workers() + 1;
+  int limit = ThreadPool::ThreadLimit();
+  if (limit > 0) nthread = std::min(nthread, static_cast<size_t>(limit));
+  grain = std::max(grain, static_cast<size_t>(1));
+  size_t nchunk = std::min(nthread, (end - begin + grain - 1) / grain);
+  if (nchunk <= 1) {
+    fchunk(begin, end);
+    return;
+  }
+  size_t step = (end - begin + nchunk - 1) / nchunk;
+  // state shared with the helpers, which can start after the loop returns.
+  struct LoopState {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  std::shared_ptr<LoopState> st = std::make_shared<LoopState>();
+  // the function is only called before done reaches nchunk.
+  const std::function<void(size_t, size_t)>* pf = &fchunk;
+  auto work = [st, pf, begin, end, step, nchunk]() {
+    size_t i;
+    while ((i = st->next.fetch_add(1)) < nchunk) {
+      size_t cbegin = begin + i * step;
+      if (cbegin < end) (*pf)(cbegin, std::min(cbegin + step, end));
+      if (st->done.fetch_add(1) + 1 == nchunk) {
+        std::lock_guard<std::mutex> lock(st->mutex);
+        st->cv.notify_all();
+      }
+    }
+  };
+  for (size_t i = 1; i < nchunk; ++i) {
+    pool->Push(work);
+  }
+  work();
+  std::unique_lock<std::mutex> lock(st->mutex);
+  st->cv.wait(lock, [&st, nchunk]() { return st->done.load() == nchunk; });
+}
+
+/*!
+ * \brief reduce over [begin, end) in parallel.
+ * \param begin begin of the range.
+ * \param end end of the range.
+ * \param grain minimum size of each chunk.
+ * \param init initial value of the reduction.
+ * \param fmap function T(chunk_begin, chunk_end) to reduce a chunk.
+ * \param freduce function T(T, T) to combine two partial results.
+ * \return the reduced value.
+ */
+template<typename T, typename FMap, typename FReduce>
+inline T ParallelReduce(size_t begin, size_t end, size_t grain, T init,
+                        FMap fmap, FReduce freduce) {
+  if (end <= begin) return init;
+  grain = std::max(grain, static_cast<size_t>(1));
+  size_t nchunk = ThreadPool::Global()->num_workers() + 1;
+  int limit = ThreadPool::ThreadLimit();
+  if (limit > 0) nchunk = std::min(nchunk, static_cast<size_t>(limit));
+  nchunk = std::max(std::min(nchunk, (end - begin + grain - 1) / grain),
+                    static_cast<size_t>(1));
+  size_t step = (end - begin + nchunk - 1) / nchunk;
+  std::vector<T> partial(nchunk, init);
+  ParallelFor(0, nchunk, 1, [&](size_t cbegin, size_t cend) {
+      for (size_t i = cbegin; i < cend; ++i) {
+        size_t rbegin = begin + i * step;
+        size_t rend = std::min(rbegin + step, end);
+        if (rbegin < rend) partial[i] = fmap(rbegin, rend);
+      }
+    });
+  T ret = init;
+  for (size_t i = 0; i < nchunk; ++i) {
+    if (begin + i * step < end) ret = freduce(ret, partial[i]);
+  }
+  return ret;
+}
+
+}  // namespace tinyflow
+
+#endif  // TINYFLOW_THREAD_POOL_H_
@@ -0,0 +1,187 @@
+/*!
+ *  Copyright (c) 2016 by Contributors
+ * \file storage_arena.h
+ * \brief allocator of the cpu torch storages owned by tinyflow.
+ */
+#ifndef TINYFLOW_TORCH_STORAGE_ARENA_H_
+#define TINYFLOW_TORCH_STORAGE_ARENA_H_
+
+#include <dmlc/json.h>
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#include <TH/TH.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace tinyflow {
+
+/*!
+ * \brief process wide arena behind the THAllocator of tinyflow storages.
+ *  Blocks are 64-byte aligned and rounded up to a size class, freed blocks
+ *  are kept per size class and reused by the next storage of that class,
+ *  so replanning does not go back to malloc. Large blocks can be backed
+ *  by transparent huge pages.
+ *
+ *  Environment variables:
+ *  - TINYFLOW_STORAGE_CACHE_MB, bytes of freed blocks kept for reuse, default 256.
+ *  - TINYFLOW_STORAGE_HUGE_PAGES, advise huge pages for blocks of 2MB and more.
+ */
+class StorageArena {
+ public:
+  // alignment of each block in bytes.
+  static const size_t kAlign = 64;
+  // alignment and minimum size of blocks backed by huge pages.
+  static const size_t kHugePage = 2 << 20;
+  /*! \brief usage of the arena */
+  struct Stats {
+    // bytes of the blocks held by storages.
+    size_t used_bytes{0};
+    // bytes of the freed blocks kept for reuse.
+    size_t cached_bytes{0};
+    // number of allocations served from the cache.
+    size_t num_reused{0};
+    // number of allocations that went to the system.
+    size_t num_allocated{0};
+    inline void Save(dmlc::JSONWriter* writer) const {
+      writer->BeginObject();
+      writer->WriteObjectKeyValue("used_bytes", used_bytes);
+      writer->WriteObjectKeyValue("cached_bytes", cached_bytes);
+      writer->WriteObjectKeyValue("num_reused", num_reused);
+      writer->WriteObjectKeyValue("num_allocated", num_allocated);
+      writer->EndObject();
+    }
+  };
+  // allocate a block of at least size bytes.
+  void* Alloc(size_t size) {
+    if (size == 0) return nullptr;
+    size_t bytes = RoundSize(size);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<void*>& bucket = free_[bytes];
+      if (bucket.size() != 0) {
+        void* ptr = bucket.back();
+        bucket.pop_back();
+        stats_.cached_bytes -= bytes;
+        stats_.used_bytes += bytes;
+        ++stats_.num_reused;
+        block_bytes_[ptr] = bytes;
+        return ptr;
+      }
+    }
+    void* ptr = nullptr;
+    bool huge = huge_pages_ && bytes >= kHugePage;
+    if (posix_memalign(&ptr, huge ? kHugePage : kAlign, bytes) != 0) {
+      // release the cache and retry before giving up.
+      Trim();
+      CHECK_EQ(posix_memalign(&ptr, huge ? kHugePage : kAlign, bytes), 0)
+          << "failed to allocate storage of " << bytes << " bytes";
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.used_bytes += bytes;
+    ++stats_.num_allocated;
+    block_bytes_[ptr] = bytes;
+    return ptr;
+  }
+  // return a block to the arena.
+  void Free(void* ptr) {
+    if (ptr == nullptr) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = block_bytes_.find(ptr);
+    CHECK(it != block_bytes_.end()) << "free of memory not allocated by the arena";
+    size_t bytes = it->second;
+    block_bytes_.erase(it);
+    stats_.used_bytes -= bytes;
+    if (stats_.cached_bytes + bytes > cache_limit_) {
+      lock.unlock();
+      free(ptr);
+      return;
+    }
+    free_[bytes].push_back(ptr);
+    stats_.cached_bytes += bytes;
+  }
+  // give the cached blocks back to the system.
+  void Trim() {
+    std::unordered_map<size_t, std::vector<void*> > blocks;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      blocks.swap(free_);
+      stats_.cached_bytes = 0;
+    }
+    for (auto& kv : blocks) {
+      for (void* ptr : kv.second) free(ptr);
+    }
+  }
+  // current usage.
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+  // the THAllocator to create storages with, the context is the arena.
+  THAllocator* allocator() {
+    return &allocator_;
+  }
+  /*! \return the process wide arena, never destroyed as lua may free storages at exit. */
+  static StorageArena* Global() {
+    static StorageArena* inst = new StorageArena();
+    return inst;
+  }
+
+ private:
+  StorageArena() {
+    cache_limit_ = static_cast<size_t>(
+        dmlc::GetEnv("TINYFLOW_STORAGE_CACHE_MB", 256)) << 20;
+    huge_pages_ = dmlc::GetEnv("TINYFLOW_STORAGE_HUGE_PAGES", false);
+    allocator_.malloc = [](void* ctx, ptrdiff_t size) {
+      return static_cast<StorageArena*>(ctx)->Alloc(static_cast<size_t>(size));
+    };
+    allocator_.realloc = [](void* ctx, void* ptr, ptrdiff_t size) {
+      // storages are resized by copying into a new block.
+      StorageArena* arena = static_cast<StorageArena*>(ctx);
+      void* ret = arena->Alloc(static_cast<size_t>(size));
+      if (ptr != nullptr && ret != nullptr) {
+        size_t old_bytes = arena->BlockBytes(ptr);
+        memcpy(ret, ptr, std::min(old_bytes, static_cast<size_t>(size)));
+      }
+      arena->Free(ptr);
+      return ret;
+    };
+    allocator_.free = [](void* ctx, void* ptr) {
+      static_cast<StorageArena*>(ctx)->Free(ptr);
+    };
+  }
+  // size class of a block: multiples of kAlign up to 4KB,
+  // then four classes between successive powers of two.
+  static size_t RoundSize(size_t size) {
+    size_t bytes = (size + kAlign - 1) / kAlign * kAlign;
+    if (bytes <= 4096) return bytes;
+    size_t step = 1024;
+    while ((step << 3) < bytes) step <<= 1;
+    return (bytes + step - 1) / step * step;
+  }
+  size_t BlockBytes(void* ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return block_bytes_.at(ptr);
+  }
+
+  THAllocator allocator_;
+  size_t cache_limit_{0};
+  bool huge_pages_{false};
+  Stats stats_;
+  // size of each block in use.
+  std::unordered_map<void*, size_t> block_bytes_;
+  // freed blocks by size.
+  std::unordered_map<size_t, std::vector<void*> > free_;
+  std::mutex mutex_;
+};
+
+}  // namespace tinyflow
+
+#endif  // TINYFLOW_TORCH_STORAGE_ARENA_H_
@@ -9,7 +9,12 @@
 #include <tinyflow/base.h>
 #include <dmlc/lua.h>
 #include <dmlc/thread_local.h>
+#include <TH/TH.h>
+#include <luaT.h>
+#include <string>
+#include <unordered_map>
 #include <vector>
+#include "./storage_arena.h"
 
 namespace dmlc {
 namespace lua_stack {
@@ -81,9 +86,16 @@ class TorchState {
     LOG(INFO) << "finished gpu initialization...";
     gpu_init_ = true;
   }
-  // create a new storage with given size
+  // create a new storage with given size,
+  // cpu storages are allocated from the StorageArena.
   LuaRef NewStorage(size_t size, int dev_mask = kCPU, int dtype = 0) {
     CHECK_EQ(dtype, 0) << "only float is supported so far";
+    if (dev_mask == kCPU) {
+      StorageArena* arena = StorageArena::Global();
+      return PushNew(THFloatStorage_newWithAllocator(
+          static_cast<ptrdiff_t>(size), arena->allocator(), arena),
+                     "torch.FloatStorage");
+    }
     if (fstorage_new_.is_nil()) {
       auto* lua = LuaState::ThreadLocalState();
       fstorage_new_ = lua->Eval(R"(
@@ -99,9 +111,62 @@ class TorchState {
     }
     return fstorage_new_(size, dev_mask);
   }
+  // create a new storage that wraps memory of given size without owning it.
+  LuaRef NewStorageShared(void* dptr, size_t size, int dev_mask = kCPU) {
+    if (dev_mask == kCPU) {
+      return PushNew(NewFloatStorageShared(dptr, size), "torch.FloatStorage");
+    }
+    if (fstorage_new_shared_.is_nil()) {
+      auto* lua = LuaState::ThreadLocalState();
+      fstorage_new_shared_ = lua->Eval(R"(
+      return
+      function(ptr, size, dev_mask)
+        if dev_mask == 1 then
+          return torch.FloatStorage(size, ptr)
+        else
+          return torch.CudaStorage(size, ptr)
+        end
+      end
+      )");
+    }
+    return fstorage_new_shared_(
+        reinterpret_cast<intptr_t>(dptr), size, dev_mask);
+  }
+  // point a cpu storage created by NewStorageShared to another memory
+  // of size elements. All tensors and views on the storage see the new memory,
+  // the caller must make sure they fit in it.
+  void RebindStorage(const LuaRef& storage, void* dptr, size_t size) {
+    LuaState::ThreadLocalState()->PRun_([&storage, dptr, size](lua_State* L) {
+        THFloatStorage* s = ToUData<THFloatStorage>(L, storage, "torch.FloatStorage");
+        CHECK(s != nullptr) << "only cpu float storage can be rebound";
+        CHECK_EQ(s->flag & TH_STORAGE_FREEMEM, 0)
+            << "cannot rebind a storage that owns its memory";
+        s->data = static_cast<float*>(dptr);
+        s->size = static_cast<ptrdiff_t>(size);
+      });
+  }
+  // give the memory of storages created by NewStorage back to the arena
+  // and clear the list, instead of waiting for the lua garbage collector.
+  // Tensors still on the storages must be reset before they are used again.
+  void ReleaseStorage(std::vector<LuaRef>* storages) {
+    LuaState::ThreadLocalState()->PRun_([storages](lua_State* L) {
+        for (const LuaRef& storage : *storages) {
+          THFloatStorage* s = ToUData<THFloatStorage>(L, storage, "torch.FloatStorage");
+          if (s == nullptr || s->allocator != StorageArena::Global()->allocator() ||
+              (s->flag & TH_STORAGE_FREEMEM) == 0) continue;
+          s->allocator->free(s->allocatorContext, s->data);
+          s->data = nullptr;
+          s->size = 0;
+        }
+      });
+    storages->clear();
+  }
   // create a new empty tensor container
   LuaRef NewTensorEmpty(int dev_mask = kCPU, int dtype = 0) {
     CHECK_EQ(dtype, 0) << "only float is supported so far";
+    if (dev_mask == kCPU) {
+      return PushNew(THFloatTensor_new(), "torch.FloatTensor");
+    }
     if (ftensor_new_.is_nil()) {
       auto* lua = LuaState::ThreadLocalState();
       ftensor_new_ = lua->Eval(R"(
@@ -121,6 +186,14 @@ class TorchState {
   // The memory is managed by src.
   LuaRef NewTensorShared(TBlob src) {
     CHECK_EQ(src.dtype, 0) << "only float is supported so far";
+    if (src.dev_mask == kCPU) {
+      THFloatStorage* s = NewFloatStorageShared(src.data, src.shape.Size());
+      THFloatTensor* t = THFloatTensor_new();
+      SetFloatTensor(t, s, src.shape);
+      // the tensor holds its own reference of the storage.
+      THFloatStorage_free(s);
+      return PushNew(t, "torch.FloatTensor");
+    }
     if (ftensor_new_shared_.is_nil()) {
       auto* lua = LuaState::ThreadLocalState();
       ftensor_new_shared_ = lua->Eval(R"(
@@ -159,6 +232,15 @@ class TorchState {
   void ResetStorage(LuaRef tensor,
                     LuaRef storage,
                     TShape shape) {
+    bool done = false;
+    LuaState::ThreadLocalState()->PRun_([&](lua_State* L) {
+        THFloatTensor* t = ToUData<THFloatTensor>(L, tensor, "torch.FloatTensor");
+        THFloatStorage* s = ToUData<THFloatStorage>(L, storage, "torch.FloatStorage");
+        if (t == nullptr || s == nullptr) return;
+        SetFloatTensor(t, s, shape);
+        done = true;
+      });
+    if (done) return;
     if (ftensor_set_.is_nil()) {
       auto* lua = LuaState::ThreadLocalState();
       ftensor_set_ = lua->Eval(R"(
@@ -176,6 +258,17 @@ class TorchState {
   // Get the internal TBlob representation of
   // The tensor object must stay alive to keep the space valid.
   TBlob GetTBlob(LuaRef tensor) {
+    TBlob ret;
+    bool done = false;
+    LuaState::ThreadLocalState()->PRun_([&](lua_State* L) {
+        THFloatTensor* t = ToUData<THFloatTensor>(L, tensor, "torch.FloatTensor");
+        if (t == nullptr) return;
+        ret.data = THFloatTensor_data(t);
+        ret.shape = TShape(t->size, t->size + t->nDimension);
+        ret.dev_mask = kCPU;
+        done = true;
+      });
+    if (done) return ret;
     if (fget_internal_.is_nil()) {
       auto* lua = LuaState::ThreadLocalState();
       fget_internal_ = lua->Eval(R"(
@@ -197,25 +290,93 @@ class TorchState {
       )");
     }
     LuaRef temp = fget_internal_(tensor);
-    TBlob ret;
     ret.data = reinterpret_cast<void*>(temp[1].Get<intptr_t>());
     ret.shape = temp[2].Get<TShape>();
     ret.dev_mask = temp[3].Get<int>();
     return ret;
   }
+  // Get the function returned by lua code, compiled once per thread
+  // and cached by name. The code must not depend on anything but the name.
+  const LuaRef& GetFunction(const std::string& name, const char* code) {
+    LuaRef& f = fnamed_[name];
+    if (f.is_nil()) {
+      f = LuaState::ThreadLocalState()->Eval(code);
+    }
+    return f;
+  }
+  // Get the compiled FLuaCompute function of op, cached per thread.
+  const LuaRef& GetLuaCompute(const Op* op) {
+    return GetOpFunction<FLuaCompute>(op, "FLuaCompute", &fop_compute_);
+  }
+  // Get the compiled FLuaCreateNNModule function of op, cached per thread.
+  const LuaRef& GetLuaCreateNNModule(const Op* op) {
+    return GetOpFunction<FLuaCreateNNModule>(
+        op, "FLuaCreateNNModule", &fop_create_module_);
+  }
   // return threadlocal state for torch.
   static TorchState* ThreadLocalState() {
     return dmlc::ThreadLocalStore<TorchState>::Get();
   }
 
  private:
+  template<typename FType>
+  const LuaRef& GetOpFunction(const Op* op, const char* attr_name,
+                              std::unordered_map<const Op*, LuaRef>* cache) {
+    LuaRef& f = (*cache)[op];
+    if (f.is_nil()) {
+      const std::string& code = Op::GetAttr<FType>(attr_name)[op];
+      f = LuaState::ThreadLocalState()->Eval("return " + code);
+    }
+    return f;
+  }
+
+  // the TH object of type tname held by ref, nullptr if of other type.
+  template<typename T>
+  static T* ToUData(lua_State* L, const LuaRef& ref, const char* tname) {
+    dmlc::lua_stack::Handler<LuaRef>::Push(L, ref);
+    T* ret = static_cast<T*>(luaT_toudata(L, -1, tname));
+    lua_pop(L, 1);
+    return ret;
+  }
+  // move a newly created TH object into lua, which takes over its reference.
+  static LuaRef PushNew(void* obj, const char* tname) {
+    auto* lua = LuaState::ThreadLocalState();
+    LuaRef ret;
+    lua->PRun_([&](lua_State* L) {
+        luaT_pushudata(L, obj, tname);
+        ret = dmlc::lua_stack::Handler<LuaRef>::Get(L, -1, lua);
+        lua_pop(L, 1);
+      });
+    return ret;
+  }
+  // a float storage wrapping dptr, the memory is neither freed nor resized
+  // by the storage, same as torch.FloatStorage(size, ptr).
+  static THFloatStorage* NewFloatStorageShared(void* dptr, size_t size) {
+    THFloatStorage* s = THFloatStorage_newWithData(
+        static_cast<float*>(dptr), static_cast<ptrdiff_t>(size));
+    s->flag = TH_STORAGE_REFCOUNTED;
+    return s;
+  }
+  // view the front of storage s as a contiguous tensor of shape.
+  static void SetFloatTensor(THFloatTensor* t, THFloatStorage* s, const TShape& shape) {
+    std::vector<long> size(shape.begin(), shape.end());  // NOLINT(*)
+    THFloatTensor_setStorageNd(t, s, 0, static_cast<int>(size.size()),
+                               dmlc::BeginPtr(size), nullptr);
+  }
+
   bool gpu_init_{false};
   LuaRef fstorage_new_;
+  LuaRef fstorage_new_shared_;
   LuaRef ftensor_new_;
   LuaRef ftensor_new_shared_;
   LuaRef ftensor_set_;
   LuaRef fcopy_from_to_;
   LuaRef fget_internal_;
+  // compiled helper functions by name.
+  std::unordered_map<std::string, LuaRef> fnamed_;
+  // compiled op functions by op.
+  std::unordered_map<const Op*, LuaRef> fop_compute_;
+  std::unordered_map<const Op*, LuaRef> fop_create_module_;
 };
 
 }  // namespace tinyflow
@@ -130,6 +130,19 @@ def test_pad():
     ay = sess.run(z, feed_dict={x : nx})
     assert(np.mean(np.abs(ay - npy))) < 1e-6
 
+def test_run_out():
+    x = tf.placeholder(tf.float32)
+    y = x * 2
+    z = tf.exp(x)
+    ax = np.ones((2, 3))
+    ay = np.empty((2, 3), dtype=np.float32)
+    az = np.empty((2, 3), dtype=np.float32)
+    sess = tf.Session()
+    ret = sess.run([y, z], feed_dict={x:ax}, out=[ay, az])
+    assert ret[0] is ay and ret[1] is az
+    np.testing.assert_almost_equal(ay, ax * 2)
+    np.testing.assert_almost_equal(az, np.exp(ax))
+
 
 if __name__ == "__main__":
     test_ewise()
@@ -142,4 +155,5 @@ if __name__ == "__main__":
     test_softmax()
     test_argmax()
     test_pad()
+    test_run_out()
     pass
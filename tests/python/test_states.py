@@ -30,6 +30,275 @@ def test_init():
     np.testing.assert_almost_equal(ax1, np.ones((2,3)))
     np.testing.assert_almost_equal(ax2, np.zeros((2,3)))
 
+def test_save_load():
+    import os, tempfile
+    x1 = tf.Variable(tf.ones(shape=[2,3]))
+    x2 = tf.Variable(tf.zeros(shape=[4]))
+    sess = tf.Session()
+    sess.run(tf.initialize_all_variables())
+    sess.run(tf.assign(x2, tf.ones(shape=[4]) * 3))
+    fname = os.path.join(tempfile.mkdtemp(), 'model.ckpt')
+    sess.save(fname)
+    sess2 = tf.Session()
+    sess2.load(fname)
+    np.testing.assert_almost_equal(sess2.run(x1), np.ones((2,3)))
+    np.testing.assert_almost_equal(sess2.run(x2), np.ones(4) * 3)
+    # writes to restored variables do not reach the file.
+    sess2.run(tf.assign(x1, x1 + 1))
+    np.testing.assert_almost_equal(sess2.run(x1), np.ones((2,3)) * 2)
+    sess3 = tf.Session()
+    sess3.load(fname)
+    np.testing.assert_almost_equal(sess3.run(x1), np.ones((2,3)))
+    # loading again releases the previous mapping.
+    sess3.run(tf.assign(x1, x1 + 1))
+    sess3.load(fname)
+    np.testing.assert_almost_equal(sess3.run(x1), np.ones((2,3)))
+    os.remove(fname)
+
+def test_executor_cache():
+    x = tf.Variable(tf.zeros(shape=[2,3]))
+    step = tf.assign(x, x + 1)
+    for policy in ['lru', 'lfu']:
+        sess = tf.Session('cpu,cache_size=2,cache_policy=%s' % policy)
+        sess.run(tf.assign(x, tf.zeros(shape=[2,3])))
+        for i in range(3):
+            sess.run(step)
+            ax = sess.run(x)
+            np.testing.assert_almost_equal(ax, np.ones((2,3)) * (i + 1))
+    # three graphs in a cache of two, each new executor sets up its closures once.
+    p = tf.placeholder(tf.float32)
+    graphs = [(p + 1, lambda v: v + 1), (p * 2, lambda v: v * 2),
+              (p - 3, lambda v: v - 3)]
+    nx = np.ones((2,3))
+    # graph 2 evicts graph 0 under lru, the less used graph 1 under lfu,
+    # then graph 0 is rebuilt only under lru.
+    for policy, num_setup in [('lru', 4), ('lfu', 3)]:
+        sess = tf.Session('cpu,profile,cache_size=2,cache_policy=%s' % policy)
+        for k in [0, 0, 0, 1, 2, 0]:
+            y, fy = graphs[k]
+            np.testing.assert_almost_equal(sess.run(y, feed_dict={p: nx}), fy(nx))
+        phases = sess.profile()["phases"]
+        assert phases["SetupOpExecs"]["count"] == num_setup, (policy, phases)
+
+def test_rebuilt_graph():
+    sess = tf.Session()
+    for i in range(3):
+        x = tf.placeholder(tf.float32, name='x')
+        y = x * 2 + 1
+        ay = sess.run(y, feed_dict={x: np.ones((2,3)) * i})
+        np.testing.assert_almost_equal(ay, np.ones((2,3)) * (2 * i + 1))
+
+def test_plan_cache():
+    x = tf.placeholder(tf.float32)
+    y = tf.exp(x) * 2 + x
+    for config in ['cpu', 'cpu,plan_cache_size=2']:
+        sess = tf.Session(config)
+        for i in range(6):
+            nx = np.ones((i % 3 + 1, 3)) * i
+            ay = sess.run(y, feed_dict={x: nx})
+            np.testing.assert_almost_equal(ay, np.exp(nx) * 2 + nx, decimal=4)
+
+def test_max_batch():
+    x = tf.placeholder(tf.float32)
+    y = tf.reduce_sum(tf.exp(x) * 2 + x, reduction_indices=[1])
+    sess = tf.Session('cpu,max_batch=8')
+    for batch in [8, 3, 5, 1, 8, 10, 2]:
+        nx = np.random.uniform(size=(batch, 4)).astype(np.float32)
+        ay = sess.run(y, feed_dict={x: nx})
+        np.testing.assert_almost_equal(
+            ay, np.sum(np.exp(nx) * 2 + nx, axis=1), decimal=4)
+    # closures are created once for the plan and once per smaller batch size.
+    sess = tf.Session('cpu,max_batch=8,profile')
+    for batch in [3, 5, 3, 5]:
+        nx = np.random.uniform(size=(batch, 4)).astype(np.float32)
+        ay = sess.run(y, feed_dict={x: nx})
+        np.testing.assert_almost_equal(
+            ay, np.sum(np.exp(nx) * 2 + nx, axis=1), decimal=4)
+    assert sess.profile()["phases"]["SetupOpExecs"]["count"] == 3
+
+def test_arena():
+    x = tf.placeholder(tf.float32)
+    y1 = tf.exp(x) + x * 2
+    y2 = tf.reduce_sum(x * x + 1, reduction_indices=[1])
+    for config in ['cpu', 'cpu,arena=0']:
+        sess = tf.Session(config)
+        for i in range(4):
+            nx = np.random.uniform(size=(i + 2, 5)).astype(np.float32)
+            a1 = sess.run(y1, feed_dict={x: nx})
+            a2 = sess.run(y2, feed_dict={x: nx})
+            np.testing.assert_almost_equal(a1, np.exp(nx) + nx * 2, decimal=4)
+            np.testing.assert_almost_equal(a2, np.sum(nx * nx + 1, axis=1), decimal=4)
+
+def test_parallel():
+    x = tf.Variable(tf.zeros(shape=[2,3]))
+    a = tf.placeholder(tf.float32)
+    b = tf.placeholder(tf.float32)
+    y = (a + 1) * (b * 2) + tf.exp(a - b)
+    step = tf.assign(x, x + y)
+    na = np.ones((2,3))
+    nb = np.ones((2,3)) * 2
+    ny = (na + 1) * (nb * 2) + np.exp(na - nb)
+    for config in ['cpu,parallel', 'cpu,threads=2', 'cpu,parallel,threads=2']:
+        sess = tf.Session(config)
+        sess.run(tf.assign(x, tf.zeros(shape=[2,3])))
+        for i in range(3):
+            sess.run(step, feed_dict={a: na, b: nb})
+            ax = sess.run(x)
+            np.testing.assert_almost_equal(ax, ny * (i + 1), decimal=5)
+
+def test_parallel_placeholder_reuse():
+    a = tf.placeholder(tf.float32)
+    b = tf.placeholder(tf.float32)
+    # b is first used after a is consumed, so the memory plan can give
+    # b the storage of a, the copy of b must wait for the readers of a.
+    y = tf.exp(tf.exp(a) * 2 + 1) + b * 3
+    na = np.random.uniform(size=(2,3)).astype(np.float32)
+    nb = np.random.uniform(size=(2,3)).astype(np.float32)
+    for config in ['cpu,parallel', 'cpu,parallel,threads=2']:
+        sess = tf.Session(config)
+        for i in range(3):
+            ay = sess.run(y, feed_dict={a: na, b: nb})
+            np.testing.assert_almost_equal(
+                ay, np.exp(np.exp(na) * 2 + 1) + nb * 3, decimal=3)
+    # the eight entries of y share storages.
+    for e in sess.memory_report()["executors"]:
+        assert len(e["storage_bytes"]) < 8
+
+def test_concurrent_run():
+    import threading
+    w = tf.Variable(tf.ones(shape=[2,3]))
+    x = tf.placeholder(tf.float32)
+    y = x * w + 1
+    sess = tf.Session()
+    sess.run(tf.initialize_all_variables())
+    errors = []
+    def worker(k):
+        try:
+            for i in range(10):
+                ay = sess.run(y, feed_dict={x: np.ones((2,3)) * k})
+                np.testing.assert_almost_equal(ay, np.ones((2,3)) * k + 1)
+        except Exception as e:
+            errors.append(e)
+    threads = [threading.Thread(target=worker, args=(k,)) for k in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert len(errors) == 0, errors
+
+def test_thread_exit():
+    import threading
+    w = tf.Variable(tf.zeros(shape=[2,3]))
+    x = tf.placeholder(tf.float32)
+    step = tf.assign(w, w + x)
+    sess = tf.Session()
+    def worker():
+        sess.run(tf.initialize_all_variables())
+        sess.run(step, feed_dict={x: np.ones((2,3))})
+    t = threading.Thread(target=worker)
+    t.start()
+    t.join()
+    # the variable outlives the thread that allocated it.
+    np.testing.assert_almost_equal(sess.run(w), np.ones((2,3)))
+    # the executors of the exited thread are released.
+    assert len(sess.memory_report()["executors"]) == 1
+    sess.run(step, feed_dict={x: np.ones((2,3))})
+    np.testing.assert_almost_equal(sess.run(w), np.ones((2,3)) * 2)
+
+def test_run_async():
+    w = tf.Variable(tf.zeros(shape=[2,3]))
+    x = tf.placeholder(tf.float32)
+    step = tf.assign(w, w + x)
+    sess = tf.Session()
+    sess.run(tf.initialize_all_variables())
+    futures = [sess.run_async(step, feed_dict={x: np.ones((2,3)) * k})
+               for k in range(5)]
+    # assigns take effect in the order of submission.
+    for k, f in enumerate(futures):
+        np.testing.assert_almost_equal(
+            f.result(), np.ones((2,3)) * (k * (k + 1) / 2))
+    np.testing.assert_almost_equal(sess.run(w), np.ones((2,3)) * 10)
+    # run waits for the submitted steps.
+    sess.run_async(step, feed_dict={x: np.ones((2,3))})
+    np.testing.assert_almost_equal(sess.run(w), np.ones((2,3)) * 11)
+    # done polls without taking the result.
+    f = sess.run_async(step, feed_dict={x: np.ones((2,3))})
+    while not f.done():
+        pass
+    assert f.done()
+    np.testing.assert_almost_equal(f.result(), np.ones((2,3)) * 12)
+
+def test_batcher():
+    import threading
+    x = tf.placeholder(tf.float32)
+    y = x * 2 + 1
+    sess = tf.Session()
+    batcher = sess.batcher(y, max_batch=4, timeout_ms=50)
+    errors = []
+    def worker(k):
+        try:
+            ay = batcher.run({x: np.ones((1,3)) * k})
+            np.testing.assert_almost_equal(ay, np.ones((1,3)) * (2 * k + 1))
+        except Exception as e:
+            errors.append(e)
+    threads = [threading.Thread(target=worker, args=(k,)) for k in range(8)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert len(errors) == 0, errors
+    stats = batcher.stats()
+    assert stats["num_requests"] == 8
+    assert stats["num_rows"] == 8
+    assert stats["max_batch_size"] <= 4
+    assert stats["queue_depth"] == 0
+
+def test_profile():
+    x = tf.placeholder(tf.float32)
+    y = tf.matmul(x, x, name="mm") + 1
+    sess = tf.Session("cpu,profile")
+    for i in range(3):
+        sess.run(y, feed_dict={x: np.ones((2,2))})
+    prof = sess.profile(reset=True)
+    assert prof["nodes"]["mm"]["count"] == 3
+    assert prof["ops"]["matmul"]["count"] == 3
+    assert prof["phases"]["InferShape"]["count"] >= 1
+    assert prof["phases"]["PlanMemory"]["count"] >= 1
+    assert len(sess.profile()["nodes"]) == 0
+
+def test_trace():
+    import json, os, tempfile
+    x = tf.placeholder(tf.float32)
+    y = tf.matmul(x, x, name="mm") + 1
+    sess = tf.Session("cpu,trace")
+    sess.run(y, feed_dict={x: np.ones((2,2))})
+    fname = os.path.join(tempfile.mkdtemp(), "trace.json")
+    sess.dump_trace(fname)
+    with open(fname) as f:
+        events = json.load(f)["traceEvents"]
+    mm = [e for e in events if e["name"] == "mm"]
+    assert len(mm) == 1
+    assert mm[0]["ph"] == "X"
+    assert mm[0]["args"]["bytes"] == 16
+    assert any(e["cat"] == "copy" for e in events)
+
+def test_memory_report():
+    w = tf.Variable(tf.ones(shape=[2,3]), name="w")
+    x = tf.placeholder(tf.float32)
+    y = tf.exp(x * w + 1)
+    sess = tf.Session()
+    sess.run(tf.initialize_all_variables())
+    sess.run(y, feed_dict={x: np.ones((2,3))})
+    report = sess.memory_report()
+    assert report["variables"]["w"] == 24
+    assert report["variable_bytes"] == 24
+    assert report["output_bytes"] >= 24
+    assert report["planned_peak_bytes"] > 0
+    for e in report["executors"]:
+        assert e["planned_peak_bytes"] <= e["pool_bytes"]
+        assert sum(e["storage_bytes"]) == e["pool_bytes"]
+    assert report["storage_arena"]["used_bytes"] >= 24
+
 if __name__ == "__main__":
 
     pass